@@ -25,10 +25,6 @@ NodeFlow::NodeFlow(PinName write_control, PinName sda, PinName scl, int frequenc
                    DataManager(write_control, sda, scl, frequency_hz), _radio(mosi, miso, sclk, nss, reset, dio0, dio1, 
                    dio2,dio3,dio4,dio5,rf_switch_ctl1,rf_switch_ctl2,txctl,rxctl,ant_switch,pwr_amp_ctl,tcxo),watchdog(done)
 {
-    #if(SCHEDULER)
-        scheduler=new float[1];
-    #endif /* #if(SCHEDULER) */
-    
 }
 #endif /* #if BOARD == EARHART_V1_0_0 */
 
@@ -38,9 +34,6 @@ NodeFlow::NodeFlow(PinName write_control, PinName sda, PinName scl, int frequenc
                    PinName vint, PinName gpio, int baud, PinName done) :
                    DataManager(write_control, sda, scl, frequency_hz), _radio(txu, rxu, cts, rst, vint, gpio, baud), watchdog(done)
 {
-    #if(SCHEDULER)
-        scheduler=new float[1];
-    #endif /* #if(SCHEDULER) */
 }
 #endif /* #if BOARD == WRIGHT_V1_0_0 */
 
@@ -84,20 +77,26 @@ void NodeFlow::start()
 {
     uint32_t next_time=0;
     watchdog.kick();
+    wake_timer.start();
     TP_Sleep_Manager::WakeupType_t wkp = sleep_manager.get_wakeup_type();
     
-    time_t start_time=time_now();
+    if(wkp==TP_Sleep_Manager::WakeupType_t::WAKEUP_PIN || wkp==TP_Sleep_Manager::WakeupType_t::WAKEUP_TIMER)
+    {
+        journal_replay();
+        cache_load();
+    }
+
     if(wkp==TP_Sleep_Manager::WakeupType_t::WAKEUP_PIN)
     {   
         #if (INTERRUPT_ON)
             debug("\r\n--------------------PIN WAKEUP--------------------\r\n");
             tformatter.setup();
+            sensing_group=0;
             HandleInterrupt(); /**Pure virtual function */
             uint16_t c_entries;
             tformatter.get_entries(c_entries);
             if (c_entries > 1)
             {
-                increase_mg_entries_counter(0);
                 add_payload_data(0);
                 #if(!SEND_SCHEDULER)
                     _send();
@@ -108,6 +107,10 @@ void NodeFlow::start()
                 {
                     _send();
                 }
+                else if(is_urgent_pending())
+                {
+                    _send_urgent();
+                }
             #endif /* #if(SEND_SCHEDULER) */
             is_overflow();
             get_interrupt_latency(next_time);
@@ -140,21 +143,26 @@ void NodeFlow::start()
                 _sense();
             }
             if(wakeup_flag==NodeFlow::FLAG_SENDING || wakeup_flag==NodeFlow::FLAG_SENSE_SEND ||
-                wakeup_flag==NodeFlow::FLAG_SEND_SYNCH || wakeup_flag==NodeFlow::FLAG_SENSE_SEND_SYNCH)
+                wakeup_flag==NodeFlow::FLAG_SEND_SYNCH || wakeup_flag==NodeFlow::FLAG_SENSE_SEND_SYNCH ||
+                is_deadline_due())
             { 
                 _send();
             }
+            else if(is_urgent_pending())
+            {
+                _send_urgent();
+            }
 
-            time_t end_time=time_now();
-            int latency=end_time-start_time;
+            /** The wake timer doesn't move with the clock synch, the start of the wake is kept */
+            int latency=(wake_timer.read_ms()+500)/1000;
             set_scheduler(latency, next_time);
 
-            //todo: check this because the latency changes if you get a timestamp 
             if(wakeup_flag == NodeFlow::FLAG_CLOCK_SYNCH || wakeup_flag == NodeFlow::FLAG_SENSE_SYNCH 
                 ||wakeup_flag == NodeFlow::FLAG_SEND_SYNCH || wakeup_flag== NodeFlow::FLAG_SENSE_SEND_SYNCH)
             {
                 get_timestamp();
-                set_scheduler(0, next_time);
+                latency=(wake_timer.read_ms()+500)/1000;
+                set_scheduler(latency, next_time);
             }
             timetodate(time_now());
            
@@ -163,21 +171,26 @@ void NodeFlow::start()
     else if(wkp==TP_Sleep_Manager::WakeupType_t::WAKEUP_RESET || wkp==TP_Sleep_Manager::WakeupType_t::WAKEUP_SOFTWARE) 
     {
         bool initialised = false;
+        bool keep_pool = false;
         #if BOARD == EARHART_V1_0_0
             DigitalIn btn(PA_8);
         #endif
         #if BOARD == WRIGHT_V1_0_0
             DigitalIn btn(PB_0);
         #endif
-        status=DataManager::is_initialised(initialised);
+        status=read_schema(initialised, keep_pool);
         if(btn.read() || !initialised)
         {
+            keep_pool=keep_pool && !btn.read();
             initialised=false;
             while(!initialised)
             {   
-                set_time(0);
-                status=initialise();
-                DataManager::is_initialised(initialised);
+                if(!keep_pool)
+                {
+                    set_time(0);
+                }
+                status=initialise(keep_pool);
+                read_schema(initialised, keep_pool);
             }
         }
 
@@ -186,6 +199,13 @@ void NodeFlow::start()
             NVIC_SystemReset(); 
         }
         status=DataManager::init_gstats();
+        journal_replay();
+        cache_load();
+        scan_mg_records();
+        /** DeltaConfig is written back with the cache, the samples of the last wake may have gone without it. 
+         *  The next sample of every series is absolute. */
+        DeltaConfig d_conf = {};
+        overwrite_config(DeltaConfig_n, d_conf.data, sizeof(d_conf.parameters));
                 
         _test_provision();
     
@@ -202,7 +222,6 @@ void NodeFlow::start()
             timetodate(time_now());
         }
         
-        start_time=time_now();
         init_sched_config();
         init_send_sched_config();
         set_scheduler(0,next_time); 
@@ -320,16 +339,89 @@ void NodeFlow::_test_provision()
 
 }
 
+/** Files created by initialise(), in eeprom order: first filename, record length, records, files and
+ *  the zeroed records written. Rows of more than one file hold consecutive filenames. A record 
+ *  longer than the uint8_t length of a DataManager file is a narrowing error.
+ *  The first POOL_FILE_ROWS rows hold the stored records, no change of the rows after them moves
+ *  their bytes, see NodeFlow::migrate_schema().
+ */
+static constexpr FileLayout file_table[] =
+{
+    {MetricPoolConfig_n,        sizeof(DataConfig::parameters),         POOL_EXTENT_CHUNKS,         POOL_EXTENTS,   0},
+    {PoolConfig_n,              sizeof(PoolConfig::parameters),         1,                          1,              1},
+    {DataTailConfig_n,          sizeof(DataTail),                       METRIC_GROUP_FILES,         1,              METRIC_GROUP_FILES},
+    {ErrorConfig_n,             sizeof(ErrorConfig::parameters),        ERROR_LOG_SLOTS,            1,              0},
+    {DeviceConfig_n,            sizeof(DeviceConfig::parameters),       1,                          1,              0},
+    {SchedulerConfig_n,         sizeof(SchedulerConfig::parameters),    MAX_BUFFER_READING_TIMES+2, 1,              1},
+    {SendSchedulerConfig_n,     sizeof(TimeConfig::parameters),         SEND_SCHEDULER_TIMES,       1,              1},
+    {MetricGroupTimesConfig_n,  sizeof(TimeConfig::parameters),         MAX_METRIC_GROUPS,          1,              0},
+    {TempMetricGroupTimesConfig_n, sizeof(TimeConfig::parameters),      MAX_METRIC_GROUPS,          1,              0},
+    {ClockSynchFlag_n,          sizeof(FlagsConfig::parameters),        1,                          1,              0},
+    {WakeStateConfig_n,         sizeof(WakeStateConfig::parameters),    1,                          1,              1},
+    {LatencyConfig_n,           sizeof(LatencyConfig::parameters),      1,                          1,              1},
+    {SendCursorConfig_n,        sizeof(SendCursorConfig::parameters),   1,                          1,              1},
+    {UploadAckConfig_n,         sizeof(UploadAckConfig::parameters),    1,                          1,              1},
+    {JournalConfig_n,           sizeof(JournalConfig::parameters),      JOURNAL_ENTRIES,            1,              0},
+    {DeltaConfig_n,             sizeof(DeltaConfig::parameters),        1,                          1,              1},
+    {IncrementAConfig_n,        sizeof(CounterConfig::parameters),      COUNTER_SLOTS,              3,              1},
+    {EventConfig_n,             sizeof(EventConfig::parameters),        1,                          1,              1},
+    {SchemaConfig_n,            sizeof(SchemaConfig::parameters),       1,                          1,              0}
+};
+
+static constexpr int file_table_bytes()
+{
+    int bytes=0;
+    for(const FileLayout& file : file_table)
+    {
+        bytes+=file.record_length*file.records*file.files;
+    }
+    return bytes;
+}
+
+static constexpr bool file_table_fits()
+{
+    for(const FileLayout& file : file_table)
+    {
+        if(file.record_length == 0 || file.records == 0 || file.files == 0 || file.zero > file.records)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(file_table_fits(), "Empty file in the file table");
+static_assert(file_table_bytes() <= EEPROM_BYTES, "The file table doesn't fit the eeprom");
+static_assert(IncrementBConfig_n == IncrementAConfig_n+1 && IncrementCConfig_n == IncrementAConfig_n+2, 
+              "The increment files share a row of the file table");
+static_assert(MAX_METRIC_GROUPS >= 1 && MAX_METRIC_GROUPS <= 12, "A metric group is a bit of EVENT_GROUPS");
+static_assert(MetricGroupConfig_n+MAX_METRIC_GROUPS <= UINT8_MAX, "Metric group ids are filenames");
+static_assert(POOL_EXTENTS > METRIC_GROUP_FILES, "A full pool must hold a group with an extent to evict");
+static_assert(file_table[0].filename == MetricPoolConfig_n && file_table[1].filename == PoolConfig_n &&
+              file_table[POOL_FILE_ROWS-1].filename == DataTailConfig_n, "The pool rows lead the file table");
+
 /** Initialise the EEPROM
  * @return Status
  */
-int NodeFlow::initialise()
+int NodeFlow::initialise(bool keep_pool)
 {    
     DigitalOut buzzer(TP_SPI_NSS); //todo: remove specific to the app
     buzzer=1;
     ThisThread::sleep_for(50);
     buzzer=0;
 
+    PoolConfig pool_conf;
+    DataTailConfig tail_conf;
+    int chunks[POOL_EXTENTS];
+    if(keep_pool)
+    {
+        status=read_schema_pool(pool_conf, tail_conf, chunks);
+        if(status != NODEFLOW_OK)
+        {
+            return status;
+        }
+    }
+
     status=DataManager::init_filesystem();
     if(status != NODEFLOW_OK)
     {
@@ -337,32 +429,42 @@ int NodeFlow::initialise()
     }
     status=DataManager::init_gstats();
 
-    DataManager_FileSystem::File_t ErrorConfig_File_t;
-    ErrorConfig_File_t.parameters.filename = ErrorConfig_n;
-    ErrorConfig_File_t.parameters.length_bytes = sizeof(ErrorConfig::parameters);
+    #if(SEND_SCHEDULER && BOARD == EARHART_V1_0_0)
+        debug("\r\nWARNING!! SEND SCHEDULER IS ON FOR EARHART BOARD\r\nVisit https://www.loratools.nl/#/airtime to find \r\nout more. Max payload per msg 255 bytes\r\n");     
+    #endif /* #if(SEND_SCHEDULER && BOARD == EARHART_V1_0_0) */
 
-    status=DataManager::add_file(ErrorConfig_File_t, 1); 
-    if(status != NODEFLOW_OK)
-    {
-        return status;
-    }
-    ErrorConfig e_conf;
-    e_conf.parameters.errCnt=0;
-    status= DataManager::overwrite_file_entries(ErrorConfig_n, e_conf.data, sizeof(e_conf.parameters));
-    if (status != NODEFLOW_OK)
+    char record[UINT8_MAX]={};
+    for(const FileLayout& file : file_table)
     {
-        return status;    
-    }
+        for(uint8_t i=0; i<file.files; i++)
+        {
+            DataManager_FileSystem::File_t File_t;
+            File_t.parameters.filename = file.filename+i;
+            File_t.parameters.length_bytes = file.record_length;
 
-    /**Device specifics */
-    DataManager_FileSystem::File_t DeviceConfig_File_t;
-    DeviceConfig_File_t.parameters.filename = DeviceConfig_n;
-    DeviceConfig_File_t.parameters.length_bytes = sizeof(DeviceConfig::parameters);
-    status=DataManager::add_file(DeviceConfig_File_t, 1); 
-    if(status != NODEFLOW_OK)
-    {
-        return status;
+            status=DataManager::add_file(File_t, file.records);
+            if(status != NODEFLOW_OK)
+            {
+                return status;
+            }
+            for(uint16_t y=0; y<file.zero; y++)
+            {
+                if(y == 0)
+                {
+                    status=overwrite_config(file.filename+i, record, file.record_length);
+                }
+                else
+                {
+                    status=append_config(file.filename+i, record, file.record_length);
+                }
+                if(status != NODEFLOW_OK)
+                {
+                    return status;
+                }
+            }
+        }
     }
+
     #if BOARD == EARHART_V1_0_0 || BOARD == DEVELOPMENT_BOARD_V1_1_0 /* #endif at EoF */
     DeviceConfig dev_conf;
     
@@ -397,64 +499,7 @@ int NodeFlow::initialise()
     }
 
     #endif
-        /** SchedulerConfig */
-    DataManager_FileSystem::File_t SchedulerConfig_File_t;
-    SchedulerConfig_File_t.parameters.filename = SchedulerConfig_n;  
-    SchedulerConfig_File_t.parameters.length_bytes = sizeof(SchedulerConfig::parameters);
-
-    status=DataManager::add_file(SchedulerConfig_File_t, MAX_BUFFER_READING_TIMES+2); 
-    if(status != NODEFLOW_OK)
-    {
-        return status;   
-    }
 
-    SchedulerConfig s_conf;
-    s_conf.parameters.time_comparator=0;
-    status= DataManager::overwrite_file_entries(SchedulerConfig_n, s_conf.data, sizeof(s_conf.parameters));
-    if (status != NODEFLOW_OK)
-    {
-        return status;    
-    }
-
-    /** SendSchedulerConfig 
-     */
-    DataManager_FileSystem::File_t SendSchedulerConfig_File_t;
-    SendSchedulerConfig_File_t.parameters.filename = SendSchedulerConfig_n;  
-    SendSchedulerConfig_File_t.parameters.length_bytes = sizeof( TimeConfig::parameters);
-    #if(SEND_SCHEDULER)
-        #if BOARD == EARHART_V1_0_0
-            debug("\r\nWARNING!! SEND SCHEDULER IS ON FOR EARHART BOARD\r\nVisit https://www.loratools.nl/#/airtime to find \r\nout more. Max payload per msg 255 bytes\r\n");     
-        #endif /* #if BOARD == EARHART_V1_0_0 */
-        status=DataManager::add_file(SendSchedulerConfig_File_t, MAX_BUFFER_SENDING_TIMES+2); 
-    #endif /* #if(SEND_SCHEDULER) */
-    
-    #if(!SEND_SCHEDULER)
-        status=DataManager::add_file(SendSchedulerConfig_File_t, 2);
-    #endif /* #if(!SEND_SCHEDULER) */
-    if(status != NODEFLOW_OK)
-    {
-        return status;   
-    }
-
-    TimeConfig ss_conf;
-    ss_conf.parameters.time_comparator=0;
-    status= DataManager::overwrite_file_entries(SendSchedulerConfig_n, ss_conf.data, sizeof(ss_conf.parameters));
-    if (status != NODEFLOW_OK)
-    {
-        return status;    
-    }
-    
-    /** ClockSynchFlag 
-     */
-    DataManager_FileSystem::File_t ClockSynchFlag_File_t;
-    ClockSynchFlag_File_t.parameters.filename = ClockSynchFlag_n;
-    ClockSynchFlag_File_t.parameters.length_bytes = sizeof( FlagsConfig::parameters);
-
-    status=DataManager::add_file(ClockSynchFlag_File_t, 1); 
-    if(status != NODEFLOW_OK)
-    {
-        return status;   
-    }
     #if (CLOCK_SYNCH)
         status=overwrite_clock_synch_config(DIVIDE(CLOCK_SYNCH_TIME),CLOCK_SYNCH);
     #endif /* #if (CLOCK_SYNCH) */
@@ -465,185 +510,126 @@ int NodeFlow::initialise()
     {
         return status;
     }   
-    /** FlagSSCKConfig. Every bit is a different flag. 
-     *  0:SENSE, 1:SEND, 2:CLOCK, 3:KICK && true or false for pin_wakeup
-     */
-    DataManager_FileSystem::File_t FlagSSCKConfig_File_t;
-    FlagSSCKConfig_File_t.parameters.filename = FlagSSCKConfig_n;
-    FlagSSCKConfig_File_t.parameters.length_bytes = sizeof(FlagsConfig::parameters);
-
-    status=DataManager::add_file(FlagSSCKConfig_File_t, 1);
-    if(status != NODEFLOW_OK)
-    {
-        return status;   
-    }
-    status=set_flags_config(0);  
-
-    DataManager_FileSystem::File_t NextTimeConfig_File_t;
-    NextTimeConfig_File_t.parameters.filename = NextTimeConfig_n;
-    NextTimeConfig_File_t.parameters.length_bytes = sizeof(TimeConfig::parameters);
-
-    status=DataManager::add_file(NextTimeConfig_File_t, 1);
-    if(status != NODEFLOW_OK)
-    {
-        return status;   
-    }
-
-    DataManager_FileSystem::File_t TimeConfig_File_t;
-    TimeConfig_File_t.parameters.filename = TimeConfig_n;
-    TimeConfig_File_t.parameters.length_bytes = sizeof(TimeConfig::parameters);
-    status = DataManager::add_file(TimeConfig_File_t, 1);
-    if(status != NODEFLOW_OK)
-    {
-        ErrorHandler(__LINE__,"TimeConfig",status,__PRETTY_FUNCTION__);  
-        return status;
-    }
-    
-    status = set_time_config(0);
-
-    DataManager_FileSystem::File_t MetricGroupConfig_File_t;
-    MetricGroupConfig_File_t.parameters.filename = MetricGroupConfig_n;
-    MetricGroupConfig_File_t.parameters.length_bytes = sizeof(MetricGroupConfig::parameters);
 
-    status = DataManager::add_file(MetricGroupConfig_File_t, 1);
-    if(status != NODEFLOW_OK)
+    if(keep_pool)
     {
-        return status;
+        status=migrate_schema(pool_conf, tail_conf, chunks);
+        if(status != NODEFLOW_OK)
+        {
+            return status;
+        }
     }
 
-    #if (INTERRUPT_ON)
-    DataManager_FileSystem::File_t InterruptConfig_File_t;
-    InterruptConfig_File_t.parameters.filename = InterruptConfig_n;
-    InterruptConfig_File_t.parameters.length_bytes = sizeof(DataConfig::parameters);
+    /** The schema header is written last, an interrupted initialise() is run again */
+    return overwrite_schema();
+}
 
-    status = DataManager::add_file(InterruptConfig_File_t, 14000/(METRIC_GROUPS_ON+1)); 
-    if(status != NODEFLOW_OK)
+int NodeFlow::read_schema(bool& initialised, bool& keep_pool)
+{
+    initialised=false;
+    keep_pool=false;
+    SchemaConfig sc_conf;
+    status=DataManager::read_file_entry(SchemaConfig_n, 0, sc_conf.data, sizeof(sc_conf.parameters));
+    eeprom_calls++;
+    if(status != NODEFLOW_OK || sc_conf.parameters.magic != SCHEMA_MAGIC)
     {
+        debug("\r\nNo schema header, the eeprom is initialised");
         return status;
     }
-    #endif
-  
-    DataManager_FileSystem::File_t MetricGroupAConfig_File_t;
-    MetricGroupAConfig_File_t.parameters.filename = MetricGroupAConfig_n;
-    MetricGroupAConfig_File_t.parameters.length_bytes = sizeof(DataConfig::parameters);
-    
-    #if (METRIC_GROUPS_ON > 0)
-    status = DataManager::add_file(MetricGroupAConfig_File_t, 14000/(METRIC_GROUPS_ON+1));
-    if(status != NODEFLOW_OK)
+    if(sc_conf.parameters.layout != schema_layout() || sc_conf.parameters.version != SCHEMA_VERSION)
     {
-        return status;
+        keep_pool=(sc_conf.parameters.pool == schema_pool_layout());
+        debug("\r\nSchema %d layout %04x, this build %d layout %04x, the eeprom is initialised%s",
+              sc_conf.parameters.version,sc_conf.parameters.layout,SCHEMA_VERSION,schema_layout(),
+              keep_pool ? ", the stored records are kept" : "");
+        return NODEFLOW_OK;
     }
-    #endif
-
-    #if (SCHEDULER_B || METRIC_GROUPS_ON >=2)
-    DataManager_FileSystem::File_t MetricGroupBConfig_File_t;
-    MetricGroupBConfig_File_t.parameters.filename = MetricGroupBConfig_n;
-    MetricGroupBConfig_File_t.parameters.length_bytes = sizeof(DataConfig::parameters);
+    initialised=true;
+    return NODEFLOW_OK;
+}
 
-    status = DataManager::add_file(MetricGroupBConfig_File_t, 14000/(METRIC_GROUPS_ON+1));
+int NodeFlow::overwrite_schema()
+{
+    SchemaConfig sc_conf;
+    sc_conf.parameters.magic=SCHEMA_MAGIC;
+    sc_conf.parameters.version=SCHEMA_VERSION;
+    sc_conf.parameters.layout=schema_layout();
+    sc_conf.parameters.pool=schema_pool_layout();
+    eeprom_calls++;
+    status=DataManager::overwrite_file_entries(SchemaConfig_n, sc_conf.data, sizeof(sc_conf.parameters));
     if(status != NODEFLOW_OK)
     {
-        return status;
+        ErrorHandler(__LINE__,"SchemaConfig",status,__PRETTY_FUNCTION__);
     }
-    #endif /* #if (SCHEDULER_B || METRIC_GROUPS_ON==2) */
-
-    #if (SCHEDULER_C || METRIC_GROUPS_ON >=3)
-        DataManager_FileSystem::File_t MetricGroupCConfig_File_t;
-        MetricGroupCConfig_File_t.parameters.filename = MetricGroupCConfig_n;
-        MetricGroupCConfig_File_t.parameters.length_bytes = sizeof(DataConfig::parameters);
-        status = DataManager::add_file(MetricGroupCConfig_File_t, 14000/(METRIC_GROUPS_ON+1));
-    
-        if(status != NODEFLOW_OK)
-        {
-            return status;
-        }
-
-    #endif /* #if (SCHEDULER_C || METRIC_GROUPS_ON==3) */
-
-    #if (SCHEDULER_D|| METRIC_GROUPS_ON==4)
-        DataManager_FileSystem::File_t MetricGroupDConfig_File_t;
-        MetricGroupDConfig_File_t.parameters.filename = MetricGroupDConfig_n;
-        MetricGroupDConfig_File_t.parameters.length_bytes = sizeof(DataConfig::parameters);
-
-        status = DataManager::add_file(MetricGroupDConfig_File_t, 14000/(METRIC_GROUPS_ON+1));
-        if(status != NODEFLOW_OK)
-        {
-            return status;
-        }
-    #endif /* #if (SCHEDULER_B || METRIC_GROUPS_ON=42) */
-    
-   
-    DataManager_FileSystem::File_t MetricGroupEntriesConfig_File_t;
-    MetricGroupEntriesConfig_File_t.parameters.filename = MetricGroupEntriesConfig_n;
-    MetricGroupEntriesConfig_File_t.parameters.length_bytes = sizeof(MetricGroupEntriesConfig::parameters);
+    return status;
+}
 
-    status = DataManager::add_file(MetricGroupEntriesConfig_File_t, 1); 
-    if(status != NODEFLOW_OK)
-    {
-        return status;
-    }
+uint16_t NodeFlow::schema_layout()
+{
+    return crc16((const char*)file_table, sizeof(file_table));
+}
 
-    clear_mg_counter();
+uint16_t NodeFlow::schema_pool_layout()
+{
+    return crc16((const char*)file_table, POOL_FILE_ROWS*sizeof(FileLayout));
+}
 
-    /** IncrementAConfig
-     */
-    DataManager_FileSystem::File_t IncrementAConfig_File_t;
-    IncrementAConfig_File_t.parameters.filename = IncrementAConfig_n;
-    IncrementAConfig_File_t.parameters.length_bytes = sizeof(IncrementAConfig::parameters);
-    status=DataManager::add_file(IncrementAConfig_File_t, 1);
-    if(status != NODEFLOW_OK)
+int NodeFlow::read_schema_pool(PoolConfig& pool_conf, DataTailConfig& tail_conf, int* chunks)
+{
+    /** A group left in the journal lands in the files of the earlier build first */
+    journal_replay();
+    status=DataManager::read_file_entry(PoolConfig_n, 0, pool_conf.data, sizeof(pool_conf.parameters));
+    eeprom_calls++;
+    for(uint8_t i=0; i<METRIC_GROUP_FILES && status == NODEFLOW_OK; i++)
     {
-        return status;   
+        status=DataManager::read_file_entry(DataTailConfig_n, i, (char*)&tail_conf.parameters.group[i], sizeof(DataTail));
+        eeprom_calls++;
     }
-    IncrementAConfig i_conf;
-    i_conf.parameters.increment=0;
-
-    status= DataManager::append_file_entry(IncrementAConfig_n, i_conf.data, sizeof(i_conf.parameters));
-    if(status != NODEFLOW_OK)
+    for(uint8_t extent=0; extent<POOL_EXTENTS && status == NODEFLOW_OK; extent++)
     {
-        return status; 
+        status=DataManager::get_total_written_file_entries(MetricPoolConfig_n+extent, chunks[extent]);
+        eeprom_calls++;
     }
-
-    /** IncrementBConfig
-     */
-    DataManager_FileSystem::File_t IncrementBConfig_File_t;
-    IncrementBConfig_File_t.parameters.filename = IncrementBConfig_n;
-    IncrementBConfig_File_t.parameters.length_bytes = sizeof(IncrementBConfig::parameters);
-
-    status=DataManager::add_file(IncrementBConfig_File_t, 1);
     if(status != NODEFLOW_OK)
     {
-        return status;   
+        ErrorHandler(__LINE__,"read_schema_pool",status,__PRETTY_FUNCTION__);
     }
-    IncrementBConfig ib_conf;
-    ib_conf.parameters.increment=0;
+    return status;
+}
 
-    status= DataManager::append_file_entry(IncrementBConfig_n, ib_conf.data, sizeof(ib_conf.parameters));
-    if(status != NODEFLOW_OK)
+int NodeFlow::migrate_schema(PoolConfig& pool_conf, DataTailConfig& tail_conf, const int* chunks)
+{
+    debug("\r\nMigrating the stored records to schema %d layout %04x",SCHEMA_VERSION,schema_layout());
+    DataConfig d_conf;
+    for(uint8_t extent=0; extent<POOL_EXTENTS; extent++)
     {
-        return status; 
+        for(int chunk=0; chunk<chunks[extent]; chunk++)
+        {
+            /** The chunk is still where the earlier build appended it, appending it again counts it in the new file */
+            status=DataManager::read_file_entry(MetricPoolConfig_n+extent, chunk, d_conf.data, sizeof(d_conf.parameters));
+            if(status == NODEFLOW_OK)
+            {
+                status=DataManager::append_file_entry(MetricPoolConfig_n+extent, d_conf.data, sizeof(d_conf.parameters));
+            }
+            eeprom_calls+=2;
+            if(status != NODEFLOW_OK)
+            {
+                ErrorHandler(__LINE__,"MetricPoolConfig",status,__PRETTY_FUNCTION__);
+                return status;
+            }
+        }
     }
-    /** IncrementCConfig
-     */
-    DataManager_FileSystem::File_t IncrementCConfig_File_t;
-    IncrementCConfig_File_t.parameters.filename = IncrementCConfig_n;
-    IncrementCConfig_File_t.parameters.length_bytes = sizeof(IncrementCConfig::parameters);
-
-    status=DataManager::add_file(IncrementCConfig_File_t, 1);
-    if(status != NODEFLOW_OK)
+    /** The records of the earlier build may be coded against another format, the next record of a group is a key frame */
+    for(uint8_t i=0; i<METRIC_GROUP_FILES; i++)
     {
-        return status;   
+        tail_conf.parameters.group[i].keyframe_length=0;
     }
-
-    IncrementCConfig ic_conf;
-    ic_conf.parameters.increment=0;
-
-    status= DataManager::append_file_entry(IncrementCConfig_n, ic_conf.data, sizeof(ic_conf.parameters));
+    status=overwrite_pool(pool_conf);
     if(status != NODEFLOW_OK)
     {
-        return status; 
+        return status;
     }
-    return status;
+    return overwrite_mg_tail(tail_conf);
 }
 
 #if BOARD == EARHART_V1_0_0 || BOARD == DEVELOPMENT_BOARD_V1_1_0 /* #endif at EoF */
@@ -728,8 +714,8 @@ int NodeFlow::CreateFile(DataManager_FileSystem::File_t file, uint8_t filename,
     {
         return status;
     }
-    DataConfig t_conf;
-    t_conf.parameters.byte=length;
+    TimeConfig t_conf;
+    t_conf.parameters.time_comparator=length;
     status= DataManager::append_file_entry(filename, t_conf.data, sizeof(t_conf.parameters));
     if(status != NODEFLOW_OK)
     {
@@ -738,7 +724,7 @@ int NodeFlow::CreateFile(DataManager_FileSystem::File_t file, uint8_t filename,
 
     status = DataManager::read_file_entry(filename, 0, t_conf.data, sizeof(t_conf.parameters));
 
-    debug("\r\nNew file: %d Length: %d \r\n",filename,t_conf.parameters.byte);
+    debug("\r\nNew file: %d Length: %d \r\n",filename,t_conf.parameters.time_comparator);
     return NODEFLOW_OK;
 }
 
@@ -762,574 +748,1076 @@ template void NodeFlow::add_record<uint64_t>(uint64_t data, string str);
 template void NodeFlow::add_record<float>(float data, string str);
 template void NodeFlow::add_record<double>(double data, string str);
 
+template <typename DataType> 
+void NodeFlow::add_delta_record(DataType data, string str)
+{   
+    if (str.empty())
+    {
+        add_record<DataType>(data, str);
+        return;
+    }
+    int64_t delta;
+    bool coded=get_delta(str, (int64_t)data, delta);
+    tformatter.write_string(str);
+    uint8_t value[9];
+    uint8_t length=0;
+    if(!coded)
+    {
+        /** The absolute sample opens the series, the samples after it until the next one are differences */
+        value[length++]=0xD9; /** CBOR tag, 2 byte tag number */
+        value[length++]=uint8_t(DELTA_CBOR_TAG >> 8);
+        value[length++]=uint8_t(DELTA_CBOR_TAG);
+        for(uint8_t i=0; i<length; i++)
+        {
+            tformatter.write(value[i], TFormatter::RAW);
+        }
+        delta=(int64_t)data;
+    }
+    length=cbor_int(delta, value);
+    for(uint8_t i=0; i<length; i++)
+    {
+        tformatter.write(value[i], TFormatter::RAW);
+    }
+}
+template void NodeFlow::add_delta_record<int8_t>(int8_t data, string str);
+template void NodeFlow::add_delta_record<int16_t>(int16_t data, string str);
+template void NodeFlow::add_delta_record<int32_t>(int32_t data, string str);
+template void NodeFlow::add_delta_record<int64_t>(int64_t data, string str);
+template void NodeFlow::add_delta_record<uint8_t>(uint8_t data, string str);
+template void NodeFlow::add_delta_record<uint16_t>(uint16_t data, string str);
+template void NodeFlow::add_delta_record<uint32_t>(uint32_t data, string str);
+
+bool NodeFlow::get_delta(const string& key, int64_t value, int64_t& delta)
+{
+    DeltaConfig d_conf;
+    status=read_config(DeltaConfig_n, 0, d_conf.data, sizeof(d_conf.parameters));
+    if(status != NODEFLOW_OK)
+    {
+        ErrorHandler(__LINE__,"read_config",status,__PRETTY_FUNCTION__);
+        return false;
+    }
+    uint16_t hash=crc16(key.c_str(), key.length(), crc16((const char*)&sensing_group, 1));
+    if(hash == 0)
+    {
+        hash=1;
+    }
+    uint8_t i=hash%DELTA_KEYS;
+    
+    bool coded=(d_conf.parameters.key[i] == hash && d_conf.parameters.samples[i] < DELTA_INTERVAL-1
+                && !__builtin_sub_overflow(value, d_conf.parameters.value[i], &delta));
+    d_conf.parameters.samples[i]=coded ? d_conf.parameters.samples[i]+1 : 0;
+    d_conf.parameters.key[i]=hash;
+    d_conf.parameters.value[i]=value;
+
+    status=overwrite_config(DeltaConfig_n, d_conf.data, sizeof(d_conf.parameters));
+    if(status != NODEFLOW_OK)
+    {
+        ErrorHandler(__LINE__,"overwrite_config",status,__PRETTY_FUNCTION__);
+        return false;
+    }
+    return coded;
+}
+
 int NodeFlow::add_payload_data(uint8_t metric_group_flag) 
 {
     uint16_t c_entries;
     tformatter.get_entries(c_entries);
     if( c_entries>1)
     {
-        uint8_t buffer[100];
-        size_t buffer_len=0;
-        tformatter.get_serialised(buffer, buffer_len);
-        for (int i=0; i<buffer_len; i++)
+        uint8_t buffer[RECORD_HEADER_SIZE+MAX_RECORD_SIZE];
+        size_t stamp_len=0;
+        status=stamp_record(metric_group_flag, &buffer[RECORD_HEADER_SIZE], stamp_len);
+        if(status!=NODEFLOW_OK)
         {
-            status=add_sensing_entry(buffer[i],metric_group_flag);
+            return status;
+        }
+        size_t buffer_len=0;
+        tformatter.get_serialised(&buffer[RECORD_HEADER_SIZE+stamp_len], buffer_len);
+        buffer_len+=stamp_len;
+        bool keyframe=true;
+        #if(METRIC_COMPRESSION)
+            status=compress_payload(metric_group_flag, &buffer[RECORD_HEADER_SIZE], buffer_len, keyframe);
             if(status!=NODEFLOW_OK)
             {
                 return status;
             }
-        } 
+        #endif
+        buffer[0]=buffer_len | (keyframe ? 0 : RECORD_COMPRESSED);
+        uint16_t crc=crc16((char*)&buffer[RECORD_HEADER_SIZE], buffer_len, crc16((char*)buffer, 1));
+        memcpy(&buffer[1], &crc, sizeof(crc));
+        status=add_sensing_entries(buffer, RECORD_HEADER_SIZE+buffer_len, metric_group_flag, keyframe);
+        if(status!=NODEFLOW_OK)
+        {
+            return status;
+        }
     }
     return NODEFLOW_OK;
 }
 
-int NodeFlow::add_sensing_entry(uint8_t value, uint8_t metric_group)
+int NodeFlow::stamp_record(uint8_t metric_group, uint8_t* data, size_t& length)
 {
-    uint8_t filename=0;
-    if(metric_group==0)
-    {  
-        #if(INTERRUPT_ON)
-        filename=InterruptConfig_n;
-        #endif
-    }
-    
-    if(metric_group==1)
+    length=0;
+    if(get_mg_filename(metric_group) == 0)
     {
-        filename=MetricGroupAConfig_n; 
-    }
-    
-    if(metric_group==2)
-    {    
-        #if (SCHEDULER_B || METRIC_GROUPS_ON==4 || METRIC_GROUPS_ON==3 || METRIC_GROUPS_ON==2)
-        filename=MetricGroupBConfig_n;
-        #endif
+        return NODEFLOW_OK;
     }
-    if(metric_group==3)
+    DataTailConfig tail_conf;
+    status=read_mg_tail(tail_conf);
+    if(status != NODEFLOW_OK)
     {
-        #if (SCHEDULER_C  || METRIC_GROUPS_ON==4 || METRIC_GROUPS_ON==3)
-        filename=MetricGroupCConfig_n;
-        #endif
-    }
-    if(metric_group==4)
-    {   
-        #if (SCHEDULER_D || METRIC_GROUPS_ON==4)
-        filename=MetricGroupDConfig_n;
-        #endif
+        return status;
     }
-    if (filename != 0)
+    uint32_t now=time(NULL);
+    uint32_t& base=tail_conf.parameters.group[metric_group].base_time;
+    if(base == 0)
     {
-        DataConfig t_conf;
-        t_conf.parameters.byte=value;
-        status= DataManager::append_file_entry(filename, t_conf.data, sizeof(t_conf.parameters));
+        base=now;
+        status=overwrite_mg_tail(tail_conf);
         if(status != NODEFLOW_OK)
         {
-            ErrorHandler(__LINE__,"MetricGroupsConfig",status,__PRETTY_FUNCTION__);
             return status;
         }
     }
-    
+    /** A clock synch can move the time before the base, the stamp is kept in 32 bits */
+    int64_t delta=std::max(std::min(int64_t(now)-int64_t(base), int64_t(INT32_MAX)), int64_t(INT32_MIN));
+    length=cbor_int(delta, data);
     return NODEFLOW_OK;
 }
 
-/** Increment A is erased after reading the value (have to be stored immediately)
- *  Increment B is erased only if the user manually erase it
- *  Increment C is erased after the data are sent
- */
- //TODo:  erase after read 
-uint16_t NodeFlow::read_inc_a()
+uint8_t NodeFlow::cbor_int(int64_t value, uint8_t* data)
 {
-    IncrementAConfig i_conf;
-    status = DataManager::read_file_entry(IncrementAConfig_n, 0, i_conf.data, sizeof(i_conf.parameters));
-    if (status != NODEFLOW_OK)
+    uint8_t major=0x00;
+    uint64_t argument=value;
+    if(value < 0)
     {
-        ErrorHandler(__LINE__,"IncrementAConfig",status,__PRETTY_FUNCTION__);   
+        major=0x20;
+        argument=-1-value;
     }
-    uint16_t increment_value=i_conf.parameters.increment;
-i_conf.parameters.increment=0;
-    status= DataManager::overwrite_file_entries(IncrementAConfig_n, i_conf.data, sizeof(i_conf.parameters));
-    if (status != NODEFLOW_OK)
+    uint8_t bytes=0;
+    if(argument < 24)
     {
-        ErrorHandler(__LINE__,"IncrementAConfig",status,__PRETTY_FUNCTION__);   
+        data[0]=major | argument;
+        return 1;
     }
-    
-    return increment_value;
-}
-
-int NodeFlow::inc_a(int i)
-{
-    IncrementAConfig i_conf;
-    status = DataManager::read_file_entry(IncrementAConfig_n, 0, i_conf.data, sizeof(i_conf.parameters));
-    if (status != NODEFLOW_OK)
+    else if(argument <= UINT8_MAX)
     {
-        ErrorHandler(__LINE__,"IncrementAConfig",status,__PRETTY_FUNCTION__);   
+        data[0]=major | 24;
+        bytes=1;
     }
-   
-    i_conf.parameters.increment=i+i_conf.parameters.increment;
-    status= DataManager::overwrite_file_entries(IncrementAConfig_n, i_conf.data, sizeof(i_conf.parameters));
-    if (status != NODEFLOW_OK)
+    else if(argument <= UINT16_MAX)
     {
-        ErrorHandler(__LINE__,"IncrementAConfig",status,__PRETTY_FUNCTION__); 
+        data[0]=major | 25;
+        bytes=2;
     }
-
-    return status;
-}
-
-int NodeFlow::read_inc_b(uint16_t& increment_value)
-{
-    IncrementBConfig i_conf;
-    status = DataManager::read_file_entry(IncrementBConfig_n, 0, i_conf.data, sizeof(i_conf.parameters));
-    if (status != NODEFLOW_OK)
+    else if(argument <= UINT32_MAX)
     {
-        ErrorHandler(__LINE__,"IncrementBConfig",status,__PRETTY_FUNCTION__);   
+        data[0]=major | 26;
+        bytes=4;
     }
-    increment_value = i_conf.parameters.increment;
-
-    return status;
+    else
+    {
+        data[0]=major | 27;
+        bytes=8;
+    }
+    for(uint8_t i=0; i<bytes; i++)
+    {
+        data[bytes-i]=argument >> (8*i);
+    }
+    return bytes+1;
 }
 
-int NodeFlow::clear_inc_b()
+uint8_t NodeFlow::get_mg_filename(uint8_t metric_group)
 {
-    IncrementBConfig i_conf;
-    i_conf.parameters.increment=0;
-    status = DataManager::overwrite_file_entries(IncrementBConfig_n, i_conf.data, sizeof(i_conf.parameters));
-    if (status != NODEFLOW_OK)
+    uint8_t filename=0;
+    if(metric_group==0)
+    {  
+        #if(INTERRUPT_ON)
+        filename=InterruptConfig_n;
+        #endif
+    }
+    else if(metric_group <= metric_group_count)
     {
-        ErrorHandler(__LINE__,"IncrementAConfig",status,__PRETTY_FUNCTION__);   
+        filename=MetricGroupConfig_n+metric_group-1; 
     }
-    return status;
-
+    return filename;
 }
 
-int NodeFlow::inc_b(int i)
+uint8_t NodeFlow::get_mg_group(uint8_t filename)
 {
-    IncrementBConfig i_conf;
-    status = DataManager::read_file_entry(IncrementBConfig_n, 0, i_conf.data, sizeof(i_conf.parameters));
-    if (status != NODEFLOW_OK)
-    {
-        ErrorHandler(__LINE__,"IncrementBConfig",status,__PRETTY_FUNCTION__);   
-    }
-
-    i_conf.parameters.increment=i+i_conf.parameters.increment;
-    status = DataManager::overwrite_file_entries(IncrementBConfig_n, i_conf.data, sizeof(i_conf.parameters));
-    if (status != NODEFLOW_OK)
+    for(uint8_t i=0; i<METRIC_GROUP_FILES; i++)
     {
-        ErrorHandler(__LINE__,"IncrementBConfig",status,__PRETTY_FUNCTION__); 
+        if(get_mg_filename(i)==filename)
+        {
+            return i;
+        }
     }
-    return status;
+    return 0;
 }
 
-int NodeFlow::read_inc_c(uint64_t& increment_value)
+/** Fills the tail chunk of the group and appends it to the file every time it's full.
+ *  A record of n bytes costs n/DATA_CHUNK_SIZE appends plus one tail read and overwrite, the record is
+ *  counted in the same tail write.
+ */
+int NodeFlow::add_sensing_entries(uint8_t* data, size_t length, uint8_t metric_group, bool keyframe)
 {
-    IncrementCConfig i_conf;
-    status = DataManager::read_file_entry(IncrementCConfig_n, 0, i_conf.data, sizeof(i_conf.parameters));
-    if (status != NODEFLOW_OK)
+    uint8_t filename=get_mg_filename(metric_group);
+    if (filename == 0 || length == 0)
     {
-        ErrorHandler(__LINE__,"IncrementCConfig",status,__PRETTY_FUNCTION__);   
+        return NODEFLOW_OK;
     }
-    increment_value=i_conf.parameters.increment;
 
-    return status;
-}
+    DataTailConfig tail_conf;
+    status=read_mg_tail(tail_conf);
+    if(status != NODEFLOW_OK)
+    {
+        return status;
+    }
+    PoolConfig pool_conf;
+    status=read_pool(pool_conf);
+    if(status != NODEFLOW_OK)
+    {
+        return status;
+    }
+    int bytes=0;
+    status=get_mg_file_bytes(filename, tail_conf, bytes);
+    if(status != NODEFLOW_OK)
+    {
+        return status;
+    }
+    /** Bytes left after the checkpoint are counted by the boot scan, this record with them */
+    bool counted=(tail_conf.parameters.group[metric_group].checked == bytes);
+    if(keyframe)
+    {
+        tail_conf.parameters.group[metric_group].keyframe=bytes;
+        tail_conf.parameters.group[metric_group].keyframe_length=length;
+    }
 
-int NodeFlow::inc_c(int i)
-{
-    uint64_t increment_value;
-    status=read_inc_c(increment_value);
-    if (status == NODEFLOW_OK)
+    uint8_t& tail_len=tail_conf.parameters.group[metric_group].length;
+    size_t done=0;
+    while(done<length)
     {
-        IncrementCConfig i_conf;
-        i_conf.parameters.increment = i+increment_value;
-        status = DataManager::overwrite_file_entries(IncrementCConfig_n, i_conf.data, sizeof(i_conf.parameters));
-        if (status != NODEFLOW_OK)
+        size_t n=std::min(length-done, size_t(DATA_CHUNK_SIZE-tail_len));
+        memcpy(&tail_conf.parameters.group[metric_group].byte[tail_len], &data[done], n);
+        tail_len+=n;
+        done+=n;
+
+        if(tail_len == DATA_CHUNK_SIZE)
         {
-            ErrorHandler(__LINE__,"IncrementCConfig",status,__PRETTY_FUNCTION__); 
+            int chunks=0;
+            status=get_mg_chunks(metric_group, pool_conf, chunks);
+            if(status != NODEFLOW_OK)
+            {
+                return status;
+            }
+            if(chunks == pool_conf.parameters.extents[metric_group]*POOL_EXTENT_CHUNKS)
+            {
+                status=allocate_mg_extent(metric_group, pool_conf, tail_conf);
+                if(status != NODEFLOW_OK)
+                {
+                    return status;
+                }
+                /** The extent handed out is empty, the group may have lost its oldest one to it */
+                chunks=(pool_conf.parameters.extents[metric_group]-1)*POOL_EXTENT_CHUNKS;
+            }
+            uint8_t extent=get_mg_extent(pool_conf, metric_group, pool_conf.parameters.extents[metric_group]-1);
+            DataConfig t_conf;
+            memcpy(t_conf.parameters.byte, tail_conf.parameters.group[metric_group].byte, DATA_CHUNK_SIZE);
+            status= DataManager::append_file_entry(MetricPoolConfig_n+extent, t_conf.data, sizeof(t_conf.parameters));
+            eeprom_calls++;
+            if(status != NODEFLOW_OK)
+            {
+                ErrorHandler(__LINE__,"MetricGroupsConfig",status,__PRETTY_FUNCTION__);
+                return status;
+            }
+            tail_conf.parameters.group[metric_group].chunks=chunks+1;
+            tail_len=0;
         }
     }
-    return status;
-}
+    /** An extent evicted above moved the checkpoint back with the bytes */
+    if(counted)
+    {
+        tail_conf.parameters.group[metric_group].records++;
+        tail_conf.parameters.group[metric_group].checked+=length;
+    }
 
+    return overwrite_mg_tail(tail_conf);
+}
 
-int NodeFlow::read_mg_entries_counter(uint16_t& mga_entries, uint16_t& mgb_entries,uint16_t& mgc_entries, uint16_t& mgd_entries, uint16_t& interrupt_entries,uint8_t& metric_group_active)
-{   
-    metric_group_active = 0;
-    MetricGroupEntriesConfig i_conf;
-    status = DataManager::read_file_entry(MetricGroupEntriesConfig_n, 0, i_conf.data, sizeof(i_conf.parameters));
-    
-    interrupt_entries=i_conf.parameters.InterruptEntries;
-    if (interrupt_entries != 0)
+int NodeFlow::compress_payload(uint8_t metric_group, uint8_t* data, size_t& length, bool& keyframe)
+{
+    keyframe=true;
+    /** The records of an urgent group are released a block at a time, the key frame may go first */
+    if(get_mg_priority(metric_group) == SEND_PRIORITY_URGENT)
     {
-        metric_group_active++;
+        return NODEFLOW_OK;
     }
-
-    mga_entries= i_conf.parameters.MetricGroupAEntries;
-    if (mga_entries != 0)
+    DataTailConfig tail_conf;
+    status=read_mg_tail(tail_conf);
+    if(status != NODEFLOW_OK)
+    {
+        return status;
+    }
+    int window_length=tail_conf.parameters.group[metric_group].keyframe_length;
+    if(window_length <= RECORD_HEADER_SIZE)
     {
-        metric_group_active++;
+        return NODEFLOW_OK;
     }
-    mgb_entries = i_conf.parameters.MetricGroupBEntries;
-    if (mgb_entries != 0)
+    /** A record starting in another extent than the key frame is a key frame, an extent is evicted with every
+     *  record compressed against it */
+    int bytes=0;
+    status=get_mg_file_bytes(get_mg_filename(metric_group), tail_conf, bytes);
+    if(status != NODEFLOW_OK)
     {
-        metric_group_active++;
+        return status;
     }
-    mgc_entries = i_conf.parameters.MetricGroupCEntries;
-    if (mgc_entries!=0)
+    int first=tail_conf.parameters.group[metric_group].first*DATA_CHUNK_SIZE;
+    if((first+tail_conf.parameters.group[metric_group].keyframe)/(POOL_EXTENT_CHUNKS*DATA_CHUNK_SIZE) 
+       != (first+bytes)/(POOL_EXTENT_CHUNKS*DATA_CHUNK_SIZE))
     {
-        metric_group_active++;
+        return NODEFLOW_OK;
     }
-    mgd_entries = i_conf.parameters.MetricGroupDEntries;
-    if (mgd_entries != 0)
+    uint8_t window[RECORD_HEADER_SIZE+MAX_RECORD_SIZE];
+    int total_bytes=0;
+    status=read_mg_span(get_mg_filename(metric_group), tail_conf.parameters.group[metric_group].keyframe, window_length, window, total_bytes);
+    if(status != NODEFLOW_OK || window_length != tail_conf.parameters.group[metric_group].keyframe_length)
     {
-        metric_group_active++;
+        return status;
     }
-    if (status != NODEFLOW_OK)
+
+    uint8_t out[MAX_RECORD_SIZE];
+    uint16_t window_crc;
+    memcpy(&window_crc, &window[1], sizeof(window_crc));
+    int out_length=compress_record(data, length, &window[RECORD_HEADER_SIZE], window_length-RECORD_HEADER_SIZE, window_crc, out, length);
+    if(out_length > 0)
     {
-        ErrorHandler(__LINE__,"MetricGroupEntriesConfig_n",status,__PRETTY_FUNCTION__); 
+        memcpy(data, out, out_length);
+        length=out_length;
+        keyframe=false;
     }
     return NODEFLOW_OK;
 }
 
-
-void NodeFlow::is_overflow()
+int NodeFlow::compress_record(const uint8_t* data, int length, const uint8_t* window, int window_length, 
+                              uint16_t window_crc, uint8_t* out, int max_length)
 {
-    
-    int max_mga_bytes, max_mgb_bytes, max_mgc_bytes, max_mgd_bytes, max_interrupt_bytes;
-    int mga_bytes, mgb_bytes, mgc_bytes, mgd_bytes, interrupt_bytes;
-    read_mg_bytes(mga_bytes, mgb_bytes, mgc_bytes, mgd_bytes, interrupt_bytes);
-   
-    MetricGroupEntriesConfig i_conf;
-    status = DataManager::read_file_entry(MetricGroupEntriesConfig_n, 0, i_conf.data, sizeof(i_conf.parameters));
-    #if(INTERRUPT_ON)
-    uint16_t b=METRIC_GROUPS_ON+1;
-    #endif
-    #if(!INTERRUPT_ON)
-    uint16_t b=METRIC_GROUPS_ON;
-    #endif
-    b=14000/b;
-    max_mga_bytes=(mga_bytes/i_conf.parameters.MetricGroupAEntries)*2+mga_bytes;
-    max_mgb_bytes=(mgb_bytes/i_conf.parameters.MetricGroupBEntries)*2+mgb_bytes;
-    max_mgc_bytes=(mgc_bytes/i_conf.parameters.MetricGroupCEntries)*2+mgc_bytes;
-    max_mgd_bytes=(mgd_bytes/i_conf.parameters.MetricGroupDEntries)*2+mgd_bytes;
-    max_interrupt_bytes=(interrupt_bytes/i_conf.parameters.InterruptEntries)*2+interrupt_bytes;
-    
-    if(max_mga_bytes > b || max_mgb_bytes > b || max_mgc_bytes > b || max_mgd_bytes > b || max_interrupt_bytes > b)
+    int o=0;
+    int literals=0;
+    memcpy(out, &window_crc, sizeof(window_crc));
+    o+=sizeof(window_crc);
+    int i=0;
+    while(i<length)
     {
-        debug("\r\nMEMORYY FULL");
-        status=_send();
-        if(status<NODEFLOW_OK)
+        /** Longest match in the key frame and the bytes before i, they can overlap i */
+        int match_length=0;
+        int match_offset=0;
+        for(int s=0; s<window_length+i; s++)
         {
-            #if(INTERRUPT_ON)
-            if(max_interrupt_bytes > b )
+            int l=0;
+            while(i+l<length && l<COMPRESSION_MAX_MATCH)
             {
-                status=DataManager::truncate_file(InterruptConfig_n, (mga_bytes/i_conf.parameters.InterruptEntries)*(int(i_conf.parameters.MetricGroupAEntries*0.2)));
-                if(status==NodeFlow::NODEFLOW_OK)
+                int src=s+l;
+                uint8_t b=(src<window_length) ? window[src] : data[src-window_length];
+                if(b != data[i+l])
                 {
-                    i_conf.parameters.InterruptEntries=i_conf.parameters.InterruptEntries-int(i_conf.parameters.MetricGroupAEntries*0.2); 
+                    break;
                 }
+                l++;
+            }
+            if(l > match_length)
+            {
+                match_length=l;
+                match_offset=s;
             }
-            #endif
+        }
 
-            if(max_mga_bytes > b )
+        if(match_length < COMPRESSION_MIN_MATCH)
+        {
+            literals++;
+            i++;
+        }
+        if(literals != 0 && (match_length >= COMPRESSION_MIN_MATCH || literals == 0x80 || i == length))
+        {
+            if(o+1+literals >= max_length)
             {
-                status=DataManager::truncate_file(MetricGroupAConfig_n, (mga_bytes/i_conf.parameters.MetricGroupAEntries)*(int(i_conf.parameters.MetricGroupAEntries*0.2)));
-                if(status==NodeFlow::NODEFLOW_OK)
-                {
-                    i_conf.parameters.MetricGroupAEntries=i_conf.parameters.MetricGroupAEntries-(int(i_conf.parameters.MetricGroupAEntries*0.2));
-                }
+                return -1;
             }
-            if(max_mgb_bytes > b)
+            out[o++]=literals-1;
+            memcpy(&out[o], &data[i-literals], literals);
+            o+=literals;
+            literals=0;
+        }
+        if(match_length >= COMPRESSION_MIN_MATCH)
+        {
+            if(o+2 >= max_length)
             {
-                status=DataManager::truncate_file(MetricGroupBConfig_n, (mgb_bytes/i_conf.parameters.MetricGroupBEntries)*(int(i_conf.parameters.MetricGroupAEntries*0.2)));
-                if(status==NodeFlow::NODEFLOW_OK)
-                {
-                    i_conf.parameters.MetricGroupBEntries=i_conf.parameters.MetricGroupBEntries-(int(i_conf.parameters.MetricGroupAEntries*0.2));
-                }
+                return -1;
             }
+            out[o++]=0x80 | (match_length-COMPRESSION_MIN_MATCH);
+            out[o++]=match_offset;
+            i+=match_length;
+        }
+    }
+    return o;
+}
 
-            if(max_mgc_bytes > b )
+int NodeFlow::decompress_record(const uint8_t* data, int length, uint8_t* out)
+{
+    uint16_t window_crc;
+    if(length < int(sizeof(window_crc)) || record_window_length == 0)
+    {
+        return -1;
+    }
+    memcpy(&window_crc, data, sizeof(window_crc));
+    if(window_crc != record_window_crc)
+    {
+        return -1;
+    }
+    int o=0;
+    int i=sizeof(window_crc);
+    while(i<length)
+    {
+        uint8_t token=data[i++];
+        if(token & 0x80)
+        {
+            int match_length=(token & 0x7F)+COMPRESSION_MIN_MATCH;
+            if(i >= length || o+match_length > MAX_RECORD_SIZE || data[i] >= record_window_length+o)
             {
-                status=DataManager::truncate_file(MetricGroupCConfig_n, (mgc_bytes/i_conf.parameters.MetricGroupCEntries)*(int(i_conf.parameters.MetricGroupAEntries*0.2)));
-                if(status==NodeFlow::NODEFLOW_OK)
-                {
-                    i_conf.parameters.MetricGroupCEntries=i_conf.parameters.MetricGroupCEntries-(int(i_conf.parameters.MetricGroupAEntries*0.2));
-                }
+                return -1;
             }
-
-            if(max_mgd_bytes > b )
+            int src=data[i++];
+            for(int l=0; l<match_length; l++, src++)
             {
-                status=DataManager::truncate_file(MetricGroupDConfig_n, (mgd_bytes/i_conf.parameters.MetricGroupDEntries)*(int(i_conf.parameters.MetricGroupAEntries*0.2)));
-                if(status==NodeFlow::NODEFLOW_OK)
-                {
-                    i_conf.parameters.MetricGroupDEntries=i_conf.parameters.MetricGroupDEntries-(int(i_conf.parameters.MetricGroupAEntries*0.2));
-                }
+                out[o++]=(src<record_window_length) ? record_window[src] : out[src-record_window_length];
             }
-
-            status= DataManager::overwrite_file_entries(MetricGroupEntriesConfig_n, i_conf.data, sizeof(i_conf.parameters));
-            if (status!=NODEFLOW_OK)
+        }
+        else
+        {
+            int literals=token+1;
+            if(i+literals > length || o+literals > MAX_RECORD_SIZE)
             {
-                ErrorHandler(__LINE__,"MetricGroupEntriesConfig_n",status,__PRETTY_FUNCTION__); 
+                return -1;
             }
-       }
+            memcpy(&out[o], &data[i], literals);
+            o+=literals;
+            i+=literals;
+        }
     }
+    return o;
 }
 
-int NodeFlow::read_mg_bytes(int& mga_bytes, int& mgb_bytes, int& mgc_bytes,int& mgd_bytes, int& interrupt_bytes)
+/** A record per group, the file is always written whole
+ */
+int NodeFlow::read_mg_tail(DataTailConfig& tail_conf)
 {
-    mga_bytes=0;
-    mgb_bytes=0;
-    mgc_bytes=0;
-    mgd_bytes=0;
-    interrupt_bytes=0;
-    #if (INTERRUPT_ON)
-        status= DataManager::get_total_written_file_entries(InterruptConfig_n, interrupt_bytes);
+    for(uint8_t i=0; i<METRIC_GROUP_FILES; i++)
+    {
+        DataTail& tail=tail_conf.parameters.group[i];
+        status=read_config(DataTailConfig_n, i, (char*)&tail, sizeof(tail));
         if(status != NODEFLOW_OK)
         {
-            ErrorHandler(__LINE__,"get_total_written_file_entries",status,__PRETTY_FUNCTION__);
+            ErrorHandler(__LINE__,"DataTailConfig",status,__PRETTY_FUNCTION__);
             return status;
         }
-    #endif
-    status= DataManager::get_total_written_file_entries(MetricGroupAConfig_n, mga_bytes);
+    }
+    return status;
+}
+
+int NodeFlow::overwrite_mg_tail(DataTailConfig& tail_conf)
+{
+    status=overwrite_config(DataTailConfig_n, tail_conf.data, sizeof(tail_conf.parameters));
     if(status != NODEFLOW_OK)
     {
-        ErrorHandler(__LINE__,"get_total_written_file_entries",status,__PRETTY_FUNCTION__);
-        return status;
+        ErrorHandler(__LINE__,"DataTailConfig",status,__PRETTY_FUNCTION__);
     }
-    #if (SCHEDULER_B  || METRIC_GROUPS_ON==4 || METRIC_GROUPS_ON==3 || METRIC_GROUPS_ON==2)
-    status= DataManager::get_total_written_file_entries(MetricGroupBConfig_n, mgb_bytes);
+    return status;
+}
+
+int NodeFlow::get_mg_file_bytes(uint8_t filename, DataTailConfig& tail_conf, int& bytes)
+{
+    bytes=0;
+    PoolConfig pool_conf;
+    status=read_pool(pool_conf);
     if(status != NODEFLOW_OK)
     {
-        ErrorHandler(__LINE__,"get_total_written_file_entries",status,__PRETTY_FUNCTION__);
         return status;
     }
-    #endif
-    #if (SCHEDULER_C || METRIC_GROUPS_ON==4 || METRIC_GROUPS_ON==3)
-    status= DataManager::get_total_written_file_entries(MetricGroupCConfig_n, mgc_bytes);
+    int chunks=0;
+    uint8_t metric_group=get_mg_group(filename);
+    status=get_mg_chunks(metric_group, pool_conf, chunks);
     if(status != NODEFLOW_OK)
     {
-        ErrorHandler(__LINE__,"get_total_written_file_entries",status,__PRETTY_FUNCTION__);
         return status;
     }
-    #endif
-    #if (SCHEDULER_D || METRIC_GROUPS_ON==4)
-    status= DataManager::get_total_written_file_entries(MetricGroupDConfig_n, mgd_bytes);
+    bytes=(chunks-tail_conf.parameters.group[metric_group].first)*DATA_CHUNK_SIZE+tail_conf.parameters.group[metric_group].length;
+    return status;
+}
+
+/** Every extent of a group but the last one is full
+ */
+int NodeFlow::get_mg_chunks(uint8_t metric_group, PoolConfig& pool_conf, int& chunks)
+{
+    chunks=0;
+    uint8_t extents=pool_conf.parameters.extents[metric_group];
+    if(extents == 0)
+    {
+        return NODEFLOW_OK;
+    }
+    status= DataManager::get_total_written_file_entries(MetricPoolConfig_n+get_mg_extent(pool_conf, metric_group, extents-1), chunks);
     if(status != NODEFLOW_OK)
     {
         ErrorHandler(__LINE__,"get_total_written_file_entries",status,__PRETTY_FUNCTION__);
         return status;
     }
-    #endif
+    chunks+=(extents-1)*POOL_EXTENT_CHUNKS;
+    return status;
+}
 
- return NODEFLOW_OK;
+int NodeFlow::ack_mg_bytes(uint8_t filename, PoolConfig& pool_conf, DataTailConfig& tail_conf, int bytes)
+{
+    int chunks=0;
+    uint8_t metric_group=get_mg_group(filename);
+    status=get_mg_chunks(metric_group, pool_conf, chunks);
+    if(status != NODEFLOW_OK)
+    {
+        return status;
+    }
+    uint16_t& first=tail_conf.parameters.group[metric_group].first;
+    uint16_t& checked=tail_conf.parameters.group[metric_group].checked;
+    tail_conf.parameters.group[metric_group].keyframe_length=0;
+    if(bytes<0)
+    {
+        first=chunks;
+        checked=0;
+        tail_conf.parameters.group[metric_group].length=0;
+        tail_conf.parameters.group[metric_group].base_time=0;
+    }
+    else
+    {
+        int released=std::min(first+bytes/DATA_CHUNK_SIZE, chunks)-first;
+        first+=released;
+        checked=std::max(checked-released*DATA_CHUNK_SIZE, 0);
+    }
 
-} 
+    /** The extents behind the pointer are freed by moving the head, their chunks are left as they are */
+    uint8_t& head=pool_conf.parameters.head[metric_group];
+    uint8_t& extents=pool_conf.parameters.extents[metric_group];
+    while(first >= POOL_EXTENT_CHUNKS)
+    {
+        head=(head+1)%POOL_EXTENTS;
+        extents--;
+        first-=POOL_EXTENT_CHUNKS;
+        chunks-=POOL_EXTENT_CHUNKS;
+    }
+    tail_conf.parameters.group[metric_group].chunks=chunks;
+    return NODEFLOW_OK;
+}
 
-int NodeFlow::increase_mg_entries_counter(uint8_t mg_flag) 
+void NodeFlow::release_mg_bytes(uint8_t metric_group, PoolConfig& pool_conf, DataTailConfig& tail_conf, int sent, int stored,
+                                uint16_t& skip)
 {
-    MetricGroupEntriesConfig i_conf;
-    status = DataManager::read_file_entry(MetricGroupEntriesConfig_n, 0, i_conf.data, sizeof(i_conf.parameters));
-    if (status == NODEFLOW_OK)
+    uint8_t filename=get_mg_filename(metric_group);
+    if(sent < 0 || sent >= stored)
     {
-        if (mg_flag == 0) //interrupt
-        {
-            i_conf.parameters.InterruptEntries=i_conf.parameters.InterruptEntries+1;
-        }
-        if (mg_flag == 1)
-        {
-            i_conf.parameters.MetricGroupAEntries=i_conf.parameters.MetricGroupAEntries+1;
-        }
-        if (mg_flag == 2)
-        {
-            i_conf.parameters.MetricGroupBEntries=i_conf.parameters.MetricGroupBEntries+1;
-        }
-        if (mg_flag == 3)
-        {
-            i_conf.parameters.MetricGroupCEntries=i_conf.parameters.MetricGroupCEntries+1;
-        }
-        if (mg_flag == 4)
-        {
-            i_conf.parameters.MetricGroupDEntries=i_conf.parameters.MetricGroupDEntries+1;
-        }
-    
-        status= DataManager::overwrite_file_entries(MetricGroupEntriesConfig_n, i_conf.data, sizeof(i_conf.parameters));
-        if (status!=NODEFLOW_OK)
-        {
-            ErrorHandler(__LINE__,"MetricGroupEntriesConfig_n",status,__PRETTY_FUNCTION__); 
-        }
+        ack_mg_bytes(filename, pool_conf, tail_conf, -1);
+        skip=0;
+        return;
     }
-    
-    return status;
+    int chunks=0;
+    get_mg_chunks(metric_group, pool_conf, chunks);
+    int released=std::min(sent/DATA_CHUNK_SIZE, chunks-tail_conf.parameters.group[metric_group].first)*DATA_CHUNK_SIZE;
+    ack_mg_bytes(filename, pool_conf, tail_conf, sent);
+    skip=sent-released;
+}
 
+uint8_t NodeFlow::get_mg_extent(const PoolConfig& pool_conf, uint8_t metric_group, uint8_t n)
+{
+    return pool_conf.parameters.extent[metric_group][(pool_conf.parameters.head[metric_group]+n)%POOL_EXTENTS];
 }
 
-int NodeFlow::clear_mg_counter()
+int NodeFlow::read_pool(PoolConfig& pool_conf)
 {
-    MetricGroupEntriesConfig mge_conf;
-    mge_conf.parameters.MetricGroupAEntries=0;
-    mge_conf.parameters.MetricGroupBEntries=0;
-    mge_conf.parameters.MetricGroupCEntries=0;
-    mge_conf.parameters.MetricGroupDEntries=0;
-    mge_conf.parameters.InterruptEntries=0;
-    status= DataManager::overwrite_file_entries(MetricGroupEntriesConfig_n, mge_conf.data, sizeof(mge_conf.parameters));
-    if (status!=NODEFLOW_OK)
-    {   
-        ErrorHandler(__LINE__,"MetricGroupEntriesConfig_n",status,__PRETTY_FUNCTION__);
+    status=read_config(PoolConfig_n, 0, pool_conf.data, sizeof(pool_conf.parameters));
+    if(status != NODEFLOW_OK)
+    {
+        ErrorHandler(__LINE__,"PoolConfig",status,__PRETTY_FUNCTION__);
     }
-    return NODEFLOW_OK;
+    return status;
 }
 
-int NodeFlow::clear_increment()
+int NodeFlow::overwrite_pool(PoolConfig& pool_conf)
 {
-    IncrementCConfig ic_conf;
-    ic_conf.parameters.increment=0;
-   
-    status= DataManager::overwrite_file_entries(IncrementCConfig_n, ic_conf.data, sizeof(ic_conf.parameters));
-    if (status!=NODEFLOW_OK)
+    status=overwrite_config(PoolConfig_n, pool_conf.data, sizeof(pool_conf.parameters));
+    if(status != NODEFLOW_OK)
     {
-        ErrorHandler(__LINE__,"IncrementCConfig",status,__PRETTY_FUNCTION__);   
+        ErrorHandler(__LINE__,"PoolConfig",status,__PRETTY_FUNCTION__);
     }
     return status;
 }
 
-int NodeFlow::metric_config_init(int length)
+int NodeFlow::allocate_mg_extent(uint8_t metric_group, PoolConfig& pool_conf, DataTailConfig& tail_conf)
 {
-    DataManager_FileSystem::File_t MetricGroupTimesConfig_File_t;
-    MetricGroupTimesConfig_File_t.parameters.filename = MetricGroupTimesConfig_n;
-    MetricGroupTimesConfig_File_t.parameters.length_bytes = sizeof(TimeConfig::parameters);
-
-    status=DataManager::add_file(MetricGroupTimesConfig_File_t, length);
-    if (status != NODEFLOW_OK) 
+    if(!journal_open)
     {
-        ErrorHandler(__LINE__,"MetricGroupTimesConfig",status,__PRETTY_FUNCTION__);
-        return status; 
+        journal_begin();
+        status=allocate_mg_extent(metric_group, pool_conf, tail_conf);
+        if(status != NODEFLOW_OK)
+        {
+            journal_abort();
+            return status;
+        }
+        return journal_commit();
     }
-    
-    DataManager_FileSystem::File_t TempMetricGroupTimesConfig_File_t;
-    TempMetricGroupTimesConfig_File_t.parameters.filename = TempMetricGroupTimesConfig_n;
-    TempMetricGroupTimesConfig_File_t.parameters.length_bytes = sizeof(TimeConfig::parameters);
 
-    status = DataManager::add_file(TempMetricGroupTimesConfig_File_t, length);
-    if(status!=NODEFLOW_OK)
+    /** A group at its limit hands its own oldest extent over, the one it writes in is kept */
+    if(metric_group != 0 && metric_groups[metric_group-1].extents != 0 && pool_conf.parameters.extents[metric_group] >= 2
+       && pool_conf.parameters.extents[metric_group] >= metric_groups[metric_group-1].extents)
     {
-        ErrorHandler(__LINE__,"TempMetricGroupTimesConfig_n",status,__PRETTY_FUNCTION__);
-        return status;
+        evict_mg_extent(pool_conf, tail_conf, metric_group);
     }
 
-    return status;   
-}
+    bool used[POOL_EXTENTS]={};
+    int owned=0;
+    for(uint8_t i=0; i<METRIC_GROUP_FILES; i++)
+    {
+        for(uint8_t y=0; y<pool_conf.parameters.extents[i]; y++)
+        {
+            used[get_mg_extent(pool_conf, i, y)]=true;
+            owned++;
+        }
+    }
+    if(owned == POOL_EXTENTS)
+    {
+        evict_mg_extent(pool_conf, tail_conf);
+        return allocate_mg_extent(metric_group, pool_conf, tail_conf);
+    }
+    uint8_t extent=0;
+    while(used[extent])
+    {
+        extent++;
+    }
 
+    /** A freed extent keeps its chunks until it is handed out again */
+    int chunks=0;
+    status=DataManager::get_total_written_file_entries(MetricPoolConfig_n+extent, chunks);
+    if(status == NODEFLOW_OK && chunks != 0)
+    {
+        status=DataManager::delete_file_entries(MetricPoolConfig_n+extent);
+        eeprom_calls++;
+    }
+    if(status != NODEFLOW_OK)
+    {
+        ErrorHandler(__LINE__,"MetricPoolConfig",status,__PRETTY_FUNCTION__);
+        return status;
+    }
 
-int NodeFlow::set_time_config(int time_comparator)
-{
-    TimeConfig t_conf;
-    t_conf.parameters.time_comparator=time_comparator;
+    uint8_t& extents=pool_conf.parameters.extents[metric_group];
+    pool_conf.parameters.extent[metric_group][(pool_conf.parameters.head[metric_group]+extents++)%POOL_EXTENTS]=extent;
+    pool_conf.parameters.fill[metric_group]++;
+    if(++pool_conf.parameters.hand_outs >= POOL_EXTENTS)
+    {
+        for(uint8_t i=0; i<METRIC_GROUP_FILES; i++)
+        {
+            pool_conf.parameters.fill[i]=(pool_conf.parameters.fill[i]+1)/2;
+        }
+        pool_conf.parameters.hand_outs=0;
+    }
 
-    status= DataManager::overwrite_file_entries(TimeConfig_n, t_conf.data, sizeof(t_conf.parameters));
-    if (status != NODEFLOW_OK)
+    status=overwrite_mg_tail(tail_conf);
+    if(status != NODEFLOW_OK)
     {
-        ErrorHandler(__LINE__,"TimeConfig",status,__PRETTY_FUNCTION__);
+        return status;
     }
-    
-    return status;
+    return overwrite_pool(pool_conf);
 }
 
-/** Scheduler Config overwrite in case of a received_message, should be less than the MAX_BUFFER_READING_TIMES
- */ 
-int NodeFlow::init_sched_config()
+void NodeFlow::evict_mg_extent(PoolConfig& pool_conf, DataTailConfig& tail_conf, uint8_t victim)
 {
-    #if(!SCHEDULER)
-        if(SCHEDULER_SIZE>4)
-        {
-            debug("\nWARNING!! Scheduler size too big,\nonly 1 interval time is associated with each metric group\n");
-        }   
-    #endif
-   
-    status=overwrite_sched_config(SCHEDULER,SCHEDULER_SIZE);
-    if (status != NODEFLOW_OK)
+    if(victim == METRIC_GROUP_FILES)
     {
-        ErrorHandler(__LINE__,"overwrite_sched_config",status,__PRETTY_FUNCTION__);
-        return status;
-    }
-    uint16_t schedulerOn;
-    read_sched_config(0,schedulerOn);
-    
-    if(schedulerOn)
-    {   
-        #if (SCHEDULER_A)
-            debug("\r\n---------------ADD SENSING TIMES GA---------------\r\n");
-            for(int i=0; i<SCHEDULER_A_SIZE; i++)
+        int fill=0;
+        for(uint8_t i=0; i<METRIC_GROUP_FILES; i++)
+        {
+            fill+=pool_conf.parameters.fill[i];
+        }
+        
+        /** Extents above the share, scaled by the total fill to stay in integers. The last extent of a group
+         *  holds its newest records and the chunk being written, a group with a single extent keeps it. */
+        int victim_excess=0;
+        for(uint8_t i=0; i<METRIC_GROUP_FILES; i++)
+        {
+            if(pool_conf.parameters.extents[i] < 2)
             {
-                status=timetoseconds(schedulerA[i],1);
-                if(status != NODEFLOW_OK)
-                {
-                    ErrorHandler(__LINE__,"timetoseconds",status,__PRETTY_FUNCTION__);
-                    return status;
-                }
-
+                continue;
             }
-        #endif     
-        #if (SCHEDULER_B)
-            debug("\r\n---------------ADD SENSING TIMES GB---------------\r\n");
-            for(int i=0; i<SCHEDULER_B_SIZE; i++)
-            {
-                status=timetoseconds(schedulerB[i],2);
-                if(status != NODEFLOW_OK)
-                {
-                    ErrorHandler(__LINE__,"timetoseconds",status,__PRETTY_FUNCTION__);
-                    return status;
-                }
-            }      
-        #endif
-        #if (SCHEDULER_C)
-            debug("\r\n---------------ADD SENSING TIMES GC---------------\r\n");       
-            for(int i=0; i<SCHEDULER_C_SIZE; i++)
+            int excess=pool_conf.parameters.extents[i]*fill-POOL_EXTENTS*pool_conf.parameters.fill[i];
+            if(victim == METRIC_GROUP_FILES || excess > victim_excess)
             {
-                status=timetoseconds(schedulerC[i],4);
-                if(status != NODEFLOW_OK)
-                {
-                    ErrorHandler(__LINE__,"timetoseconds",status,__PRETTY_FUNCTION__);
-                    return status;
-                }
+                victim=i;
+                victim_excess=excess;
             }
-        #endif
+        }
+        debug("\r\nMEMORY FULL");
+    }
+    debug("\r\nGroup %d drops %d chunks",victim,POOL_EXTENT_CHUNKS);
+
+    SendCursorConfig c_conf;
+    bool cursor=(read_send_cursor(c_conf) == NODEFLOW_OK);
+    uint16_t& first=tail_conf.parameters.group[victim].first;
+    int dropped=(POOL_EXTENT_CHUNKS-std::min(int(first), POOL_EXTENT_CHUNKS))*DATA_CHUNK_SIZE;
+    int sent=cursor ? c_conf.parameters.skip[victim] : 0;
+
+    /** The records left in the extent are dropped with it, a record running into the next extent is cut. 
+     *  The ones before skip were sent and are already off the record count, the ones before the end of 
+     *  the open upload are counted apart for its snapshot. The tables are written to the journal first 
+     *  so the walk reads the extents of this group. */
+    int upload=(cursor && c_conf.parameters.open) ? std::max(std::min(int(c_conf.parameters.bytes[victim]), dropped), sent) : sent;
+    uint16_t evicted=0;
+    uint16_t uploaded=0;
+    if(sent < dropped && overwrite_mg_tail(tail_conf) == NODEFLOW_OK && overwrite_pool(pool_conf) == NODEFLOW_OK)
+    {
+        uint8_t filename=get_mg_filename(victim);
+        RecordWalk walk={};
+        record_window_length=0;
+        if(upload > sent && parse_mg_records(filename, sent, upload, -1, false, walk) == NODEFLOW_OK)
+        {
+            uploaded=walk.records+walk.lost+(walk.consumed < upload-sent);
+        }
+        walk={};
+        if(upload < dropped && parse_mg_records(filename, upload, dropped, -1, false, walk) == NODEFLOW_OK)
+        {
+            evicted=walk.records+walk.lost+(walk.consumed < dropped-upload);
+        }
+        evicted+=uploaded;
+    }
+    uint16_t& records=tail_conf.parameters.group[victim].records;
+    records=(records > evicted) ? records-evicted : 0;
+    uint16_t& checked=tail_conf.parameters.group[victim].checked;
+    checked=(checked > dropped) ? checked-dropped : 0;
+
+    uint8_t& head=pool_conf.parameters.head[victim];
+    head=(head+1)%POOL_EXTENTS;
+    pool_conf.parameters.extents[victim]--;
+    first=(first > POOL_EXTENT_CHUNKS) ? first-POOL_EXTENT_CHUNKS : 0;
+    uint16_t& chunks=tail_conf.parameters.group[victim].chunks;
+    chunks=(chunks > POOL_EXTENT_CHUNKS) ? chunks-POOL_EXTENT_CHUNKS : 0;
+    tail_conf.parameters.group[victim].keyframe_length=0;
+
+    /** The upload of the group moves back with its bytes, the ones dropped are lost */
+    if(cursor)
+    {
+        uint16_t& bytes=c_conf.parameters.bytes[victim];
+        uint16_t& skip=c_conf.parameters.skip[victim];
+        uint16_t& entries=c_conf.parameters.entries[victim];
+        entries=(entries > uploaded) ? entries-uploaded : 0;
+        bytes=(bytes > dropped) ? bytes-dropped : 0;
+        skip=(skip > dropped) ? skip-dropped : 0;
+        if(c_conf.parameters.group == victim)
+        {
+            uint16_t& done=c_conf.parameters.done;
+            done=(done > dropped) ? std::min(done-dropped, int(bytes)) : 0;
+        }
+        overwrite_send_cursor(c_conf);
+        uint8_t order[METRIC_GROUP_FILES];
+        get_send_order(order);
+        if(c_conf.parameters.open && c_conf.parameters.bytes[victim] != 0
+           && get_send_position(order, victim) >= get_send_position(order, c_conf.parameters.group))
+        {
+            clear_block_acks(c_conf.parameters.block);
+        }
+    }
+}
+
+/** Increment A is erased after reading the value (have to be stored immediately)
+ *  Increment B is erased only if the user manually erase it
+ *  Increment C is erased after the data are sent
+ */
+uint16_t NodeFlow::read_inc_a()
+{
+    uint64_t increment_value=0;
+    status=read_counter(IncrementAConfig_n, increment_value);
+    if (status == NODEFLOW_OK)
+    {
+        overwrite_counter(IncrementAConfig_n, 0);
+    }
+    
+    return increment_value;
+}
+
+int NodeFlow::inc_a(int i)
+{
+    return increment_counter(IncrementAConfig_n, i);
+}
+
+int NodeFlow::read_inc_b(uint16_t& increment_value)
+{
+    uint64_t value=0;
+    status=read_counter(IncrementBConfig_n, value);
+    increment_value = value;
+
+    return status;
+}
+
+int NodeFlow::clear_inc_b()
+{
+    return overwrite_counter(IncrementBConfig_n, 0);
+}
+
+int NodeFlow::inc_b(int i)
+{
+    return increment_counter(IncrementBConfig_n, i);
+}
+
+int NodeFlow::read_inc_c(uint64_t& increment_value)
+{
+    return read_counter(IncrementCConfig_n, increment_value);
+}
+
+int NodeFlow::inc_c(int i)
+{
+    return increment_counter(IncrementCConfig_n, i);
+}
+
+int NodeFlow::read_counter(uint8_t filename, uint64_t& value)
+{
+    value=0;
+    int slots=0;
+    status=DataManager::get_total_written_file_entries(filename, slots);
+    if (status != NODEFLOW_OK)
+    {
+        ErrorHandler(__LINE__,"CounterConfig",status,__PRETTY_FUNCTION__);
+        return status;
+    }
+    for (int i=0; i<slots; i++)
+    {
+        CounterConfig c_conf;
+        status=DataManager::read_file_entry(filename, i, c_conf.data, sizeof(c_conf.parameters));
+        if (status != NODEFLOW_OK)
+        {
+            ErrorHandler(__LINE__,"CounterConfig",status,__PRETTY_FUNCTION__);
+            return status;
+        }
+        value+=c_conf.parameters.value;
+    }
+    return NODEFLOW_OK;
+}
 
-        #if (SCHEDULER_D)
-            debug("\r\n--------------ADD SENSING TIMES GD---------------\r\n");
-            for(int i=0; i<SCHEDULER_D_SIZE; i++)
+int NodeFlow::increment_counter(uint8_t filename, uint64_t i)
+{
+    int slots=0;
+    status=DataManager::get_total_written_file_entries(filename, slots);
+    if (status != NODEFLOW_OK)
+    {
+        ErrorHandler(__LINE__,"CounterConfig",status,__PRETTY_FUNCTION__);
+        return status;
+    }
+    if (slots == 0 || slots >= COUNTER_SLOTS)
+    {
+        uint64_t value=0;
+        if (slots != 0)
+        {
+            status=read_counter(filename, value);
+            if (status != NODEFLOW_OK)
             {
-                status=timetoseconds(schedulerD[i],8);
-                if(status != NODEFLOW_OK)
-                {
-                    ErrorHandler(__LINE__,"timetoseconds",status,__PRETTY_FUNCTION__);
-                    return status;
-                }
+                return status;
             }
-        #endif
+        }
+        return overwrite_counter(filename, value+i);
+    }
+
+    CounterConfig c_conf;
+    c_conf.parameters.value=i;
+    status=DataManager::append_file_entry(filename, c_conf.data, sizeof(c_conf.parameters));
+    if (status != NODEFLOW_OK)
+    {
+        ErrorHandler(__LINE__,"CounterConfig",status,__PRETTY_FUNCTION__); 
+    }
+    return status;
+}
+
+int NodeFlow::overwrite_counter(uint8_t filename, uint64_t value)
+{
+    CounterConfig c_conf;
+    c_conf.parameters.value=value;
+    if(journal_open)
+    {
+        journal_counter[filename-IncrementAConfig_n]=value;
+        journal_counters|=(1 << (filename-IncrementAConfig_n));
+        return journal_write(filename, sizeof(c_conf.parameters), c_conf.data, sizeof(c_conf.parameters));
+    }
+    status=DataManager::overwrite_file_entries(filename, c_conf.data, sizeof(c_conf.parameters));
+    if (status != NODEFLOW_OK)
+    {
+        ErrorHandler(__LINE__,"CounterConfig",status,__PRETTY_FUNCTION__); 
     }
+    return status;
+}
+
 
-    #if (METRIC_GROUPS_ON != 0)
-        if(!schedulerOn)
+int NodeFlow::read_mg_entries_counter(uint16_t* entries, uint8_t& metric_group_active)
+{   
+    metric_group_active = 0;
+    DataTailConfig tail_conf;
+    status = read_mg_tail(tail_conf);
+    if (status != NODEFLOW_OK)
+    {
+        return status;
+    }
+    for(uint8_t i=0; i<METRIC_GROUP_FILES; i++)
+    {
+        entries[i]=tail_conf.parameters.group[i].records;
+        if (entries[i] != 0)
         {
-            uint16_t sch_length;
-            read_sched_config(1,sch_length);
-            add_metric_groups();
-        
-            for(int i=0; i<sch_length; i++)
-            { 
-                status=append_sched_config(scheduler[i],(i)); 
-                if(status != NODEFLOW_OK)
-                {
-                    ErrorHandler(__LINE__,"append_sched_config",status,__PRETTY_FUNCTION__);
-                    return status;
-                }
-            }
+            metric_group_active++;
         }
-        #endif
+    }
     return NODEFLOW_OK;
 }
 
-int NodeFlow::timetoseconds(float scheduler_time, uint8_t group_id)
+
+/** The pool is shared, a group is not full until every extent is handed out. The data are sent
+ *  early then, if the send fails the next extent handed out evicts the oldest one of the group
+ *  above its share, see evict_mg_extent().
+ */
+void NodeFlow::is_overflow()
+{
+    PoolConfig pool_conf;
+    status=read_pool(pool_conf);
+    if(status != NODEFLOW_OK)
+    {
+        return;
+    }
+    int owned=0;
+    for(uint8_t i=0; i<METRIC_GROUP_FILES; i++)
+    {
+        owned+=pool_conf.parameters.extents[i];
+    }
+    
+    if(owned == POOL_EXTENTS)
+    {
+        debug("\r\nMEMORY FULL");
+        status=_send();
+        if(status<NODEFLOW_OK)
+        {
+            debug("\r\nSend failed, the oldest data will be evicted");
+        }
+    }
+}
+
+int NodeFlow::read_mg_bytes(int* bytes)
+{
+    DataTailConfig tail_conf;
+    status=read_mg_tail(tail_conf);
+    for(uint8_t i=0; i<METRIC_GROUP_FILES; i++)
+    {
+        bytes[i]=0;
+        uint8_t filename=get_mg_filename(i);
+        if(status == NODEFLOW_OK && filename != 0)
+        {
+            status=get_mg_file_bytes(filename, tail_conf, bytes[i]);
+        }
+    }
+    return status;
+} 
+
+void NodeFlow::clear_mg_counter(DataTailConfig& tail_conf, const uint16_t* sent)
+{
+    for(uint8_t i=0; i<METRIC_GROUP_FILES; i++)
+    {
+        uint16_t& records=tail_conf.parameters.group[i].records;
+        records=(sent != NULL && records > sent[i]) ? records-sent[i] : 0;
+    }
+}
+
+int NodeFlow::clear_increment()
+{
+    return overwrite_counter(IncrementCConfig_n, 0);
+}
+
+int NodeFlow::read_wake_state(WakeStateConfig& ws_conf)
+{
+    status=read_config(WakeStateConfig_n, 0, ws_conf.data, sizeof(ws_conf.parameters));
+    if (status != NODEFLOW_OK)
+    {
+        ErrorHandler(__LINE__,"WakeStateConfig",status,__PRETTY_FUNCTION__);
+    }
+    return status;
+}
+
+int NodeFlow::overwrite_wake_state(WakeStateConfig& ws_conf)
+{
+    status=overwrite_config(WakeStateConfig_n, ws_conf.data, sizeof(ws_conf.parameters));
+    if (status != NODEFLOW_OK)
+    {
+        ErrorHandler(__LINE__,"WakeStateConfig",status,__PRETTY_FUNCTION__);
+    }
+    return status;
+}
+
+int NodeFlow::set_time_config(int time_comparator)
+{
+    WakeStateConfig ws_conf;
+    status=read_wake_state(ws_conf);
+    if (status != NODEFLOW_OK)
+    {
+        return status;
+    }
+    ws_conf.parameters.time_comparator=time_comparator;
+    
+    return overwrite_wake_state(ws_conf);
+}
+
+/** Scheduler Config overwrite in case of a received_message, should be less than the MAX_BUFFER_READING_TIMES.
+ *  The times of the day of the registered groups go to the scheduler, their intervals to the metric group times.
+ */ 
+int NodeFlow::init_sched_config()
+{
+    uint16_t sched_length=0;
+    for(uint8_t i=0; i<metric_group_count; i++)
+    {
+        sched_length+=metric_groups[i].length;
+    }
+    if(sched_length>MAX_BUFFER_READING_TIMES)
+    {
+        debug("\nWARNING!! Scheduler size too big,\nonly the first %d times are kept\n",MAX_BUFFER_READING_TIMES);
+        sched_length=MAX_BUFFER_READING_TIMES;
+    }
+   
+    status=overwrite_sched_config(sched_length != 0,sched_length);
+    if (status != NODEFLOW_OK)
+    {
+        ErrorHandler(__LINE__,"overwrite_sched_config",status,__PRETTY_FUNCTION__);
+        return status;
+    }
+
+    uint16_t added=0;
+    for(uint8_t i=0; i<metric_group_count; i++)
+    {
+        if(metric_groups[i].length != 0)
+        {
+            debug("\r\n---------------ADD SENSING TIMES G%d---------------\r\n",i+1);
+        }
+        for(int y=0; y<metric_groups[i].length && added<sched_length; y++, added++)
+        {
+            status=timetoseconds(metric_groups[i].times[y],1<<i);
+            if(status != NODEFLOW_OK)
+            {
+                ErrorHandler(__LINE__,"timetoseconds",status,__PRETTY_FUNCTION__);
+                return status;
+            }
+        }
+    }
+
+    if(metric_group_count != 0)
+    {
+        add_metric_groups();
+    }
+    return build_event_table();
+}
+
+int NodeFlow::timetoseconds(float scheduler_time, uint16_t group_id)
 {
     uint16_t time_remainder=DIVIDE(((int(scheduler_time))*HOURINSEC)+((fmod(scheduler_time,1))*6000));
-    status=append_sched_config(time_remainder,group_id); /**group_id dec for 0001,0010,0100,1000: 1,2,4,8*/
+    status=append_sched_config(time_remainder,group_id); /**group_id a bit for each group: 1,2,4,8..*/
     if(status != NODEFLOW_OK)
     {
         ErrorHandler(__LINE__,"append_sched_config",status,__PRETTY_FUNCTION__);
@@ -1344,7 +1832,7 @@ int NodeFlow::overwrite_sched_config(uint16_t code,uint16_t length)
 {
     SchedulerConfig s_conf;
     s_conf.parameters.time_comparator=code;
-    status= DataManager::overwrite_file_entries(SchedulerConfig_n, s_conf.data, sizeof(s_conf.parameters));
+    status= overwrite_config(SchedulerConfig_n, s_conf.data, sizeof(s_conf.parameters));
     if(status != NODEFLOW_OK)
     {
         ErrorHandler(__LINE__,"SchedulerConfig",status,__PRETTY_FUNCTION__);
@@ -1352,7 +1840,7 @@ int NodeFlow::overwrite_sched_config(uint16_t code,uint16_t length)
     }
     s_conf.parameters.time_comparator=length;
 
-    status = DataManager::append_file_entry(SchedulerConfig_n, s_conf.data, sizeof(s_conf.parameters));
+    status = append_config(SchedulerConfig_n, s_conf.data, sizeof(s_conf.parameters));
     if(status != NODEFLOW_OK)
     {
         ErrorHandler(__LINE__,"SchedulerConfig",status,__PRETTY_FUNCTION__);
@@ -1362,13 +1850,13 @@ int NodeFlow::overwrite_sched_config(uint16_t code,uint16_t length)
     return status;
 }
 
-int NodeFlow::append_sched_config(uint16_t time_comparator,uint8_t group_id)
+int NodeFlow::append_sched_config(uint16_t time_comparator,uint16_t group_id)
 {
     SchedulerConfig t_conf;
     t_conf.parameters.time_comparator=time_comparator;
     t_conf.parameters.group_id=group_id;
 
-    status= DataManager::append_file_entry(SchedulerConfig_n, t_conf.data, sizeof(t_conf.parameters));
+    status= append_config(SchedulerConfig_n, t_conf.data, sizeof(t_conf.parameters));
     if(status != NODEFLOW_OK)
     {
         ErrorHandler(__LINE__,"SchedulerConfig",status,__PRETTY_FUNCTION__);
@@ -1420,21 +1908,17 @@ int NodeFlow::init_send_sched_config()
 
         else
         {  
-            #if (METRIC_GROUPS_ON !=0)
-                uint16_t sched_length;
-                read_sched_config(1,sched_length);
-                
-                if(sched_length)
+            if(metric_group_count)
+            {
+                status=append_send_sched_config(metric_groups[0].interval);
+                if(status != NODEFLOW_OK)
                 {
-                    status=append_send_sched_config(scheduler[0]);
-                    if(status != NODEFLOW_OK)
-                    {
-                        ErrorHandler(__LINE__,"append_send_sched_config",status,__PRETTY_FUNCTION__);
-                    }
+                    ErrorHandler(__LINE__,"append_send_sched_config",status,__PRETTY_FUNCTION__);
                 }
-            #endif
+            }
         }
     #endif
+    build_event_table();
 return status;
 }
 
@@ -1443,7 +1927,7 @@ int NodeFlow::overwrite_send_sched_config(uint16_t code,uint16_t length)
     TimeConfig ss_conf;
     ss_conf.parameters.time_comparator=code;
 
-    status= DataManager::overwrite_file_entries(SendSchedulerConfig_n, ss_conf.data, sizeof(ss_conf.parameters));
+    status= overwrite_config(SendSchedulerConfig_n, ss_conf.data, sizeof(ss_conf.parameters));
     if(status != NODEFLOW_OK)
     {
         ErrorHandler(__LINE__,"SendSchedulerConfig_n",status,__PRETTY_FUNCTION__);
@@ -1452,7 +1936,7 @@ int NodeFlow::overwrite_send_sched_config(uint16_t code,uint16_t length)
 
     ss_conf.parameters.time_comparator=length;
 
-    status = DataManager::append_file_entry(SendSchedulerConfig_n, ss_conf.data, sizeof(ss_conf.parameters));
+    status = append_config(SendSchedulerConfig_n, ss_conf.data, sizeof(ss_conf.parameters));
     if(status != NODEFLOW_OK)
     {
         ErrorHandler(__LINE__,"SendSchedulerConfig_n",status,__PRETTY_FUNCTION__);
@@ -1468,7 +1952,7 @@ int NodeFlow::append_send_sched_config(uint16_t time_comparator)
     TimeConfig ss_conf;
     ss_conf.parameters.time_comparator=time_comparator;
 
-    status= DataManager::append_file_entry(SendSchedulerConfig_n, ss_conf.data, sizeof(ss_conf.parameters));
+    status= append_config(SendSchedulerConfig_n, ss_conf.data, sizeof(ss_conf.parameters));
     if(status != NODEFLOW_OK)
     {
          ErrorHandler(__LINE__,"SendSchedulerConfig_n",status,__PRETTY_FUNCTION__);
@@ -1480,7 +1964,7 @@ int NodeFlow::append_send_sched_config(uint16_t time_comparator)
 int NodeFlow::read_send_sched_config(int i, uint16_t& time)
 {
     TimeConfig ss_conf;
-    status = DataManager::read_file_entry(SendSchedulerConfig_n, i, ss_conf.data, sizeof(ss_conf.parameters));
+    status = read_config(SendSchedulerConfig_n, i, ss_conf.data, sizeof(ss_conf.parameters));
     if(status != NODEFLOW_OK)
     {
          ErrorHandler(__LINE__,"SendSchedulerConfig_n",status,__PRETTY_FUNCTION__);
@@ -1498,12 +1982,12 @@ int NodeFlow::overwrite_clock_synch_config(int time_comparator, bool clockSynchO
     c_conf.parameters.flag=clockSynchOn;
     c_conf.parameters.value=time_comparator;
     
-    status = DataManager::overwrite_file_entries(ClockSynchFlag_n, c_conf.data, sizeof(c_conf.parameters));
+    status = overwrite_config(ClockSynchFlag_n, c_conf.data, sizeof(c_conf.parameters));
     int count=0;
     while(status != NODEFLOW_OK && count<MAX_OVERWRITE_RETRIES) 
     {
         ErrorHandler(__LINE__,"ClockSynchFlag",status,__PRETTY_FUNCTION__);
-        status = DataManager::overwrite_file_entries(ClockSynchFlag_n, c_conf.data, sizeof(c_conf.parameters));
+        status = overwrite_config(ClockSynchFlag_n, c_conf.data, sizeof(c_conf.parameters));
         ++count;
     } 
 
@@ -1513,7 +1997,7 @@ int NodeFlow::overwrite_clock_synch_config(int time_comparator, bool clockSynchO
 int NodeFlow::read_clock_synch_config(uint16_t& time, bool &clockSynchOn)
 {
     FlagsConfig c_conf;
-    status = DataManager::read_file_entry(ClockSynchFlag_n, 0, c_conf.data, sizeof(c_conf.parameters));
+    status = read_config(ClockSynchFlag_n, 0, c_conf.data, sizeof(c_conf.parameters));
     if (status != NODEFLOW_OK)
     {
          ErrorHandler(__LINE__,"ClockSyncConfig",status,__PRETTY_FUNCTION__);
@@ -1529,7 +2013,7 @@ int NodeFlow::read_clock_synch_config(uint16_t& time, bool &clockSynchOn)
 int NodeFlow::read_sched_config(int i, uint16_t& time_comparator)
 {
     SchedulerConfig r_conf;
-    status = DataManager::read_file_entry(SchedulerConfig_n, i, r_conf.data, sizeof(r_conf.parameters));
+    status = read_config(SchedulerConfig_n, i, r_conf.data, sizeof(r_conf.parameters));
     time_comparator=r_conf.parameters.time_comparator;
     if (status!=NODEFLOW_OK)
     {
@@ -1539,10 +2023,10 @@ int NodeFlow::read_sched_config(int i, uint16_t& time_comparator)
     return status;
 }
 
-int NodeFlow::read_sched_group_id(int i, uint8_t& group_id)
+int NodeFlow::read_sched_group_id(int i, uint16_t& group_id)
 {
     SchedulerConfig r_conf;
-    status = DataManager::read_file_entry(SchedulerConfig_n, i, r_conf.data, sizeof(r_conf.parameters));
+    status = read_config(SchedulerConfig_n, i, r_conf.data, sizeof(r_conf.parameters));
     group_id=r_conf.parameters.group_id;
     if (status!=NODEFLOW_OK)
     {
@@ -1557,56 +2041,87 @@ int NodeFlow::read_sched_group_id(int i, uint8_t& group_id)
  */
 int NodeFlow:: set_flags_config(uint8_t ssck_flag)
 {
-    FlagsConfig f_conf;
-    f_conf.parameters.value=ssck_flag;
-    f_conf.parameters.flag=0;
-
-    status= DataManager::overwrite_file_entries(FlagSSCKConfig_n, f_conf.data, sizeof(f_conf.parameters));
+    WakeStateConfig ws_conf;
+    status=read_wake_state(ws_conf);
     if(status != NODEFLOW_OK)
     {
-        ErrorHandler(__LINE__,"FlagSSCKConfig",status,__PRETTY_FUNCTION__); 
+        return status;
     }
+    ws_conf.parameters.ssck_flag=ssck_flag;
+    ws_conf.parameters.wakeup_pin=false;
 
-    return status;
+    return overwrite_wake_state(ws_conf);
 }
 
 int NodeFlow::set_wakeup_pin_flag(bool wakeup_pin)
 {
-    FlagsConfig f_conf;
-    status=DataManager::read_file_entry(FlagSSCKConfig_n, 0, f_conf.data,sizeof(f_conf.parameters));
+    WakeStateConfig ws_conf;
+    status=read_wake_state(ws_conf);
+    if(status != NODEFLOW_OK)
+    {
+        return status;
+    }
+    ws_conf.parameters.wakeup_pin=wakeup_pin;
 
-    f_conf.parameters.flag=wakeup_pin;
-    status= DataManager::overwrite_file_entries(FlagSSCKConfig_n, f_conf.data, sizeof(f_conf.parameters));
+    return overwrite_wake_state(ws_conf);
+}
 
-    if(status != NODEFLOW_OK)
+int NodeFlow::add_metric_group(Callback<void()> sense, uint32_t interval, uint8_t extents)
+{
+    if(metric_group_count == MAX_METRIC_GROUPS)
     {
-        ErrorHandler(__LINE__,"FlagSSCKConfig",status,__PRETTY_FUNCTION__);  
+        return METRIC_GROUPS_FULL;
     }
-    return status;
+    metric_groups[metric_group_count]={sense, interval, NULL, 0, extents, SEND_PRIORITY_NORMAL, 0};
+    return ++metric_group_count;
+}
+
+int NodeFlow::add_metric_group(Callback<void()> sense, const float* times, uint8_t length, uint8_t extents)
+{
+    if(metric_group_count == MAX_METRIC_GROUPS)
+    {
+        return METRIC_GROUPS_FULL;
+    }
+    metric_groups[metric_group_count]={sense, 0, times, length, extents, SEND_PRIORITY_NORMAL, 0};
+    return ++metric_group_count;
+}
+
+int NodeFlow::set_metric_group_priority(uint8_t group, uint8_t priority, uint32_t deadline)
+{
+    if(group == 0 || group > metric_group_count || priority > SEND_PRIORITY_BULK)
+    {
+        return METRIC_GROUP_INVALID;
+    }
+    metric_groups[group-1].priority=priority;
+    metric_groups[group-1].deadline=deadline;
+    return NODEFLOW_OK;
+}
+
+uint8_t NodeFlow::get_mg_priority(uint8_t metric_group)
+{
+    return (metric_group == 0) ? INTERRUPT_PRIORITY : metric_groups[metric_group-1].priority;
 }
 
-/**Ignore this for now 
+/** A record for each registered group, groups read at times of the day have no interval
  */
-#if (METRIC_GROUPS_ON != 0) /**Interrupt only */
 void NodeFlow::add_metric_groups() 
 {   
     debug("\r\n---------------ADD METRIC GROUPS------------------");
-    uint16_t sch_length;
-    read_sched_config(1,sch_length);
-    metric_config_init(sch_length);
-    TimeConfig sg_conf;
-    for (int i=0; i<sch_length; i++)
+    TimeConfig sg_conf, dl_conf;
+    uint32_t now=time(NULL);
+    for (int i=0; i<metric_group_count; i++)
     {
-        sg_conf.parameters.time_comparator=scheduler[i];
+        sg_conf.parameters.time_comparator=metric_groups[i].interval;
+        dl_conf.parameters.time_comparator=now+metric_groups[i].interval;
 
         if(i == 0)
         {
-            status= DataManager::overwrite_file_entries(MetricGroupTimesConfig_n, sg_conf.data, sizeof(sg_conf.parameters));
+            status= overwrite_config(MetricGroupTimesConfig_n, sg_conf.data, sizeof(sg_conf.parameters));
             if(status!=0)
             {
                 ErrorHandler(__LINE__,"MetricGroupTimesConfig",status,__PRETTY_FUNCTION__); 
             }
-            status= DataManager::overwrite_file_entries(TempMetricGroupTimesConfig_n, sg_conf.data, sizeof(sg_conf.parameters));
+            status= overwrite_config(TempMetricGroupTimesConfig_n, dl_conf.data, sizeof(dl_conf.parameters));
             if(status!=0)
             {
                 ErrorHandler(__LINE__,"TempMetricGroupTimesConfig_n",status,__PRETTY_FUNCTION__); 
@@ -1614,346 +2129,450 @@ void NodeFlow::add_metric_groups()
         }
         else
         {
-            status=DataManager::append_file_entry(MetricGroupTimesConfig_n, sg_conf.data, sizeof(sg_conf.parameters));
+            status=append_config(MetricGroupTimesConfig_n, sg_conf.data, sizeof(sg_conf.parameters));
             if(status!=0)
             {
                 ErrorHandler(__LINE__,"MetricGroupTimesConfig",status,__PRETTY_FUNCTION__); 
             }
 
-            status = DataManager::append_file_entry(TempMetricGroupTimesConfig_n, sg_conf.data, sizeof(sg_conf.parameters));
+            status = append_config(TempMetricGroupTimesConfig_n, dl_conf.data, sizeof(dl_conf.parameters));
             if(status!=NODEFLOW_OK)
             {
                 ErrorHandler(__LINE__,"TempMetricGroupTimesConfig_n",status,__PRETTY_FUNCTION__);
             }
         }
         
-        status = DataManager::read_file_entry(TempMetricGroupTimesConfig_n, i, sg_conf.data, sizeof(sg_conf.parameters));
-        if(status != NODEFLOW_OK)
-        {
-            ErrorHandler(__LINE__,"TempMetricGroupTimesConfig_n",status,__PRETTY_FUNCTION__); 
-        }
-        debug("\r\n%d. Metric group id: %i, wake up every: %u Seconds",i,i,sg_conf.parameters.time_comparator);
-                
-        }
-        debug("\r\n");
+        debug("\r\n%d. Metric group id: %i, wake up every: %u Seconds",i,i+1,sg_conf.parameters.time_comparator);
+    }
+    debug("\r\n");
 }
 
-#endif
-
 /**Returns seconds until next reading. Sets the flags for the next event in case of timer wakeup
  */
 void NodeFlow::set_scheduler(int latency, uint32_t& next_timediff)
 {
     bitset<8> ssck_flag(0b0000'0000);
-    uint16_t schedulerOn=0;
-    #if(METRIC_GROUPS_ON != 0)
-        uint16_t length;
-        read_sched_config(0,schedulerOn); 
-        read_sched_config(1,length);
-        debug("\r\n-----------------NEXT READING TIME----------------");
-    #endif
-    uint32_t timediff_temp=DAYINSEC;
-
-    uint32_t time_remainder=this->time_now();
-    int32_t timediff=0;
-    uint32_t next_sch_time=0; 
-    uint32_t scheduled_times=0;
-    uint16_t times;
-    uint8_t group_id=0;
-    uint8_t temp_group_id=0;
-   
-    #if(METRIC_GROUPS_ON != 0)
-        if(schedulerOn)
-        {
-            for (int i=0; i<length; i++)
-            {
-                read_sched_config(i+2,times);
-                scheduled_times=times*2;
-                scheduled_times=scheduled_times%DAYINSEC;
-                timediff=scheduled_times-time_remainder;
-                if(timediff<0)
-                {
-                    if(timediff+latency>0)
-                    {
-                        timediff=1;
-                    }
-                    else
-                    {
-                        timediff=timediff+DAYINSEC;
-                    }
-                }
-               
-                if (timediff <= timediff_temp)
-                {
-                    if (timediff < timediff_temp)
-                    {
-                        read_sched_group_id(i+2,group_id);
-                    }
-                    if (timediff == timediff_temp)
-                    {
-                        read_sched_group_id(i+2,temp_group_id);
-                        if(temp_group_id!=group_id)
-                        {
-                            group_id=group_id+temp_group_id;
-                        }             
-                    }
-                    timediff_temp=timediff;
-                    next_sch_time=scheduled_times; //this can be removed it's just to print the next sensing time & sending time 
-                    overwrite_metric_flags(group_id);
-                }
-            }
-        }
-        else if(!schedulerOn)
-        {
-            set_reading_time(timediff_temp);  
-        } 
-   #endif
-        ssck_flag.set(0);
-  
-     #if(!SEND_SCHEDULER)
-        ssck_flag.set(1);
-    #endif
+    uint32_t now=time(NULL);
+    wake_events=0;
 
-    uint16_t sendschedulerOn;
-    read_send_sched_config(0,sendschedulerOn);
-    
-    uint32_t timediff_temp_send=DAYINSEC;
-    if(sendschedulerOn)
+    /** The events of the table up to the horizon ran early in this wake */
+    WakeStateConfig ws_conf;
+    status=read_wake_state(ws_conf);
+    if(status != NODEFLOW_OK)
     {
-        uint16_t send_length;
-        uint16_t sched_time_temp;
-        read_send_sched_config(1,send_length);
-        for (int i=0; i<send_length; i++)
-        {   
-            read_send_sched_config(i+2,sched_time_temp);
-            scheduled_times=sched_time_temp*2;
-            scheduled_times=scheduled_times%DAYINSEC;
-            timediff=scheduled_times-time_remainder;
+        ErrorHandler(__LINE__,"read_wake_state",status,__PRETTY_FUNCTION__);
+    }
+    uint32_t from=now;
+    int from_latency=latency;
+    if(status == NODEFLOW_OK && now-latency+1 >= ws_conf.parameters.wake_due && ws_conf.parameters.horizon > now-latency)
+    {
+        from=ws_conf.parameters.horizon;
+        from_latency=0;
+    }
 
-            if(timediff<0)
-            {
-                timediff=timediff+DAYINSEC;
-            }
-            if (timediff<timediff_temp_send)
-            {
-                timediff_temp_send=timediff;
-                next_sch_time=scheduled_times;
-            }  
-        }
-         
-        if(timediff_temp_send<=timediff_temp)
+    uint32_t timediff=DAYINSEC;
+    uint16_t mask=0;
+    bool interval=next_event(from%DAYINSEC, from_latency, timediff, mask);
+    /** Every table event that may share the wake of the first one goes on the heap */
+    uint32_t first=from+timediff;
+    uint32_t due=first;
+    for(uint8_t i=0; i<WAKE_TABLE_EVENTS && mask != 0 && due-first <= WAKE_WINDOW_MAX; i++)
+    {
+        if(due-first <= wake_window(mask))
         {
-            ssck_flag.set(1);
-            if(timediff_temp_send<timediff_temp)
-            {
-                timediff_temp=timediff_temp_send;
-                ssck_flag.reset(0);
-            } 
+            add_wake_event(due, mask);
         }
+        next_event(due%DAYINSEC, 0, timediff, mask);
+        due+=timediff;
     }
-    //the clock synch should be send in 2 bytes, so half the value)
-    bool clockSynchOn=0;
-    uint16_t time;
-    read_clock_synch_config(time,clockSynchOn);
-    
-    uint32_t cs_time=(2*time)-time_remainder;
+    debug("\r\n-----------------NEXT READING TIME----------------");
+    if(interval)
+    {
+        add_interval_events(now);
+    }
+    add_wake_event(now+WAKE_MAX_SLEEP, EVENT_KICK);
 
-    if(clockSynchOn)
+    uint32_t horizon=0;
+    uint8_t saved=0;
+    due=next_wake_event(mask, horizon, saved);
+    if(mask != EVENT_KICK)
     {
-        if(cs_time < 0)
-        {
-            cs_time=cs_time+DAYINSEC;
-        }
-        if(cs_time<=timediff_temp)
-        {   
-            ssck_flag.set(2);
-            if(cs_time<timediff_temp)
-            {
-                timediff_temp=cs_time;
-                ssck_flag.reset(0);
-                ssck_flag.reset(1); 
-            } 
-        }
+        mask&=~EVENT_KICK;
     }
+    if(interval)
+    {
+        reschedule_interval_events(due, mask, now);
+    }
+    overwrite_metric_flags(mask & EVENT_GROUPS);
+
+    ssck_flag.set(0, mask & EVENT_GROUPS);
+    ssck_flag.set(1, mask & EVENT_SEND);
+    #if(!SEND_SCHEDULER)
+        ssck_flag.set(1, mask & ~(EVENT_CLOCK | EVENT_KICK));
+    #endif
+    ssck_flag.set(2, mask & EVENT_CLOCK);
+    ssck_flag.set(3, mask == EVENT_KICK);
+    debug("\r\nSense: %d, Send: %d, ClockSynch: %d, KickWdg: %d, Merged: %d\n", ssck_flag.test(0), ssck_flag.test(1), ssck_flag.test(2), ssck_flag.test(3), saved);
     
-    /**Check that its not more than 2 hours, 6600*/
-    if (timediff_temp>6600)  
-    {
-        timediff_temp=6600;
-        ssck_flag.reset(0);
-        ssck_flag.reset(1);
-        ssck_flag.reset(2);
-        ssck_flag.set(3);  
-    } 
-    debug("\r\nSense: %d, Send: %d, ClockSynch: %d, KickWdg: %d\n", ssck_flag.test(0), ssck_flag.test(1), ssck_flag.test(2), ssck_flag.test(3));
-    
+    /** A sensing wake starts early by the measured latency, the other events wait for their time */
+    uint32_t lead=(mask & EVENT_GROUPS) ? wake_lead() : 0;
+    next_timediff=(due > now+lead) ? due-now-lead : 1;
+    overwrite_wake_horizon(now+next_timediff, horizon, saved);
     set_flags_config(int(ssck_flag.to_ulong()));
-    overwrite_wakeup_timestamp(timediff_temp); 
-    if(!schedulerOn)
+    overwrite_wakeup_timestamp(next_timediff); 
+}
+
+void NodeFlow::add_wake_event(uint32_t due, uint16_t mask)
+{
+    if(wake_events == WAKE_EVENTS)
     {
-        latency=timediff_temp-latency-1;
-      
-        if(latency <= 0)
-        {
-            set_temp_reading_times(timediff_temp-latency);
-            timediff_temp=1;
-        }
-        else
+        return;
+    }
+    wake_heap[wake_events++]={due, mask};
+    std::push_heap(wake_heap, wake_heap+wake_events, [](const WakeEvent& a, const WakeEvent& b){ return a.due > b.due; });
+}
+
+uint32_t NodeFlow::next_wake_event(uint16_t& mask, uint32_t& horizon, uint8_t& saved)
+{
+    auto later=[](const WakeEvent& a, const WakeEvent& b){ return a.due > b.due; };
+    mask=0;
+    saved=0;
+    uint32_t due=wake_heap[0].due;
+    horizon=due;
+    while(wake_events > 0 && wake_heap[0].due-due <= wake_window(wake_heap[0].mask))
+    {
+        /** The kick of the watchdog is moved by every wake, it never costs one */
+        if(wake_heap[0].due > horizon && wake_heap[0].mask != EVENT_KICK)
         {
-            set_temp_reading_times(timediff_temp);
-            timediff_temp=latency; 
+            horizon=wake_heap[0].due;
+            saved++;
         }
+        mask|=wake_heap[0].mask;
+        std::pop_heap(wake_heap, wake_heap+wake_events, later);
+        wake_events--;
+    }
+    return due;
+}
+
+uint16_t NodeFlow::wake_window(uint16_t mask)
+{
+    uint16_t window=WAKE_MAX_SLEEP;
+    if(mask & EVENT_GROUPS)
+    {
+        window=std::min(window, uint16_t(WAKE_WINDOW_SENSE));
+    }
+    if(mask & EVENT_SEND)
+    {
+        window=std::min(window, uint16_t(WAKE_WINDOW_SEND));
+    }
+    if(mask & EVENT_CLOCK)
+    {
+        window=std::min(window, uint16_t(WAKE_WINDOW_CLOCK));
+    }
+    return window;
+}
+
+int NodeFlow::overwrite_wake_horizon(uint32_t due, uint32_t horizon, uint8_t saved)
+{
+    WakeStateConfig ws_conf;
+    status=read_wake_state(ws_conf);
+    if(status != NODEFLOW_OK)
+    {
+        return status;
     }
-    next_timediff=timediff_temp;
+    ws_conf.parameters.wake_due=due;
+    ws_conf.parameters.horizon=horizon;
+    ws_conf.parameters.wakes_saved+=saved;
+    return overwrite_wake_state(ws_conf);
 }
 
+void NodeFlow::phase_begin()
+{
+    phase_start=wake_timer.read_ms();
+}
 
-int NodeFlow::set_reading_time(uint32_t& time)
-{ 
-    //TimeConfig sg_conf;
-    TimeConfig t_conf;
-    uint16_t sch_length;
-    read_sched_config(1,sch_length);
+void NodeFlow::phase_end(uint8_t phase)
+{
+    uint32_t now=wake_timer.read_ms();
+    phase_ms[phase]+=now-phase_start;
+    phase_start=now;
+    phases_run|=(1<<phase);
+}
 
-    uint16_t temp_time[sch_length];
-    bitset<8> flags(0b0000'0000);
-    int time_comparator;
+int NodeFlow::read_latency_model(LatencyConfig& l_conf)
+{
+    return read_config(LatencyConfig_n, 0, l_conf.data, sizeof(l_conf.parameters));
+}
 
-    status = DataManager::read_file_entry(TimeConfig_n, 0, t_conf.data,sizeof(t_conf.parameters));
+int NodeFlow::overwrite_latency_model()
+{
+    LatencyConfig l_conf;
+    status=read_latency_model(l_conf);
     if(status != NODEFLOW_OK)
     {
-        ErrorHandler(__LINE__,"TimeConfig",status,__PRETTY_FUNCTION__);
+        ErrorHandler(__LINE__,"LatencyConfig",status,__PRETTY_FUNCTION__);
+        return status;
     }
-
-    time_comparator=t_conf.parameters.time_comparator; 
-    
-    status = DataManager::read_file_entry(TempMetricGroupTimesConfig_n, 0, t_conf.data, sizeof(t_conf.parameters));
+    bool changed=false;
+    for(uint8_t i=0; i<LATENCY_PHASES; i++)
+    {
+        if(!(phases_run & (1<<i)))
+        {
+            continue;
+        }
+        /** The first sample of a phase starts its average */
+        int32_t sample=std::min(phase_ms[i], uint32_t(UINT16_MAX));
+        uint16_t& average=l_conf.parameters.average[i];
+        int32_t moved=(average == 0) ? sample : average+(sample-average)/(1<<LATENCY_WEIGHT);
+        debug("\r\nPhase %d: %d ms, average %d ms", i, sample, moved);
+        if(std::abs(moved-average) >= LATENCY_RESOLUTION || (average == 0 && moved != 0))
+        {
+            average=moved;
+            changed=true;
+        }
+    }
+    if(!changed)
+    {
+        return NODEFLOW_OK;
+    }
+    status=overwrite_config(LatencyConfig_n, l_conf.data, sizeof(l_conf.parameters));
     if(status != NODEFLOW_OK)
     {
-        ErrorHandler(__LINE__,"TempMetricGroupTimesConfig_n",status,__PRETTY_FUNCTION__);
+        ErrorHandler(__LINE__,"LatencyConfig",status,__PRETTY_FUNCTION__);
+    }
+    return status;
+}
+
+uint16_t NodeFlow::wake_lead()
+{
+    LatencyConfig l_conf;
+    if(read_latency_model(l_conf) != NODEFLOW_OK)
+    {
+        return 0;
     }
+    uint32_t lead=l_conf.parameters.average[PHASE_WAKE]+l_conf.parameters.average[PHASE_SENSE]/2
+                 +l_conf.parameters.average[PHASE_FLUSH];
+    return std::min((lead+500)/1000, uint32_t(WAKE_MAX_LEAD));
+}
 
-    int temp=t_conf.parameters.time_comparator; 
+int NodeFlow::get_wakes_saved(uint32_t& wakes)
+{
+    WakeStateConfig ws_conf;
+    status=read_wake_state(ws_conf);
+    if(status != NODEFLOW_OK)
+    {
+        return status;
+    }
+    wakes=ws_conf.parameters.wakes_saved;
+    return status;
+}
 
-    for (int i=0; i<sch_length; i++)
+void NodeFlow::add_interval_events(uint32_t now)
+{
+    TimeConfig t_conf, p_conf;
+    for(int i=0; i<metric_group_count; i++)
     {
-        status=DataManager::read_file_entry(TempMetricGroupTimesConfig_n, i, t_conf.data, sizeof(t_conf.parameters));
+        status=read_config(TempMetricGroupTimesConfig_n, i, t_conf.data, sizeof(t_conf.parameters));
+        if(status == NODEFLOW_OK)
+        {
+            status=read_config(MetricGroupTimesConfig_n, i, p_conf.data, sizeof(p_conf.parameters));
+        }
         if(status != NODEFLOW_OK)
         {
             ErrorHandler(__LINE__,"TempMetricGroupTimesConfig_n",status,__PRETTY_FUNCTION__);
+            return;
         }
-        int time_comparator_now= t_conf.parameters.time_comparator;
-
-        if (temp >= time_comparator_now && time_comparator_now != 0)
+        if(p_conf.parameters.time_comparator == 0)
         {
-            flags.set(i);                    
-            if(temp>time_comparator_now)
-            {
-                for(int y=0; y<i; y++)
-                {
-                    flags.reset(y);
-                }
-            }
-            temp=time_comparator_now; 
+            continue;
         }
+        /** The clock moved back or the deadline was never set, overdue groups are all sensed at once. A group
+         *  sensed early in a merged wake is up to WAKE_WINDOW_SENSE past its period */
+        uint32_t due=std::min(t_conf.parameters.time_comparator, now+p_conf.parameters.time_comparator+WAKE_WINDOW_SENSE);
+        add_wake_event(std::max(due, now), 1<<i);
     }
-
-    time_comparator=temp;
-    overwrite_metric_flags(int(flags.to_ulong()));
-    debug("\r\nGroupA: %d, GroupB: %d, GroupC: %d, GroupD: %d", flags.test(0), flags.test(1), flags.test(2), flags.test(3));
-    time=time_comparator;
-
-    return status;
 }
-int NodeFlow::set_temp_reading_times(uint32_t time)
+
+int NodeFlow::reschedule_interval_events(uint32_t due, uint16_t mask, uint32_t now)
 {
-    TimeConfig sg_conf;
-    uint16_t sch_length;
-    read_sched_config(1,sch_length);
-    uint32_t temp_time[sch_length];
-    set_time_config(time);
+    uint8_t sch_length=metric_group_count;
+    if(sch_length == 0)
+    {
+        return NODEFLOW_OK;
+    }
+    TimeConfig t_conf;
+    TimeConfig p_conf;
     for(int i=0; i<sch_length; i++)
     {
-        status=DataManager::read_file_entry(TempMetricGroupTimesConfig_n, i, sg_conf.data, sizeof(sg_conf.parameters));
+        status=read_config(TempMetricGroupTimesConfig_n, i, t_conf.data, sizeof(t_conf.parameters));
+        if(status == NODEFLOW_OK)
+        {
+            status=read_config(MetricGroupTimesConfig_n, i, p_conf.data, sizeof(p_conf.parameters));
+        }
         if(status != NODEFLOW_OK)
         {
-            ErrorHandler(__LINE__,"MetricGroupTimesConfig_n",status,__PRETTY_FUNCTION__);
+            ErrorHandler(__LINE__,"TempMetricGroupTimesConfig_n",status,__PRETTY_FUNCTION__);
             return status;
         }
-        int time_comp=sg_conf.parameters.time_comparator-time;
-        temp_time[i]=time_comp;
-
-        if(time_comp <= 0)
+        uint32_t& deadline=t_conf.parameters.time_comparator;
+        uint32_t old_deadline=deadline;
+        deadline=std::min(deadline, now+p_conf.parameters.time_comparator+WAKE_WINDOW_SENSE);
+        /** A group merged in an earlier wake keeps its own deadline, so its period doesn't drift */
+        if(mask & (1<<i))
         {
-            status=DataManager::read_file_entry(MetricGroupTimesConfig_n, i, sg_conf.data, sizeof(sg_conf.parameters));
-            if(status != NODEFLOW_OK)
-            {
-                ErrorHandler(__LINE__,"MetricGroupTimesConfig",status,__PRETTY_FUNCTION__);
-                return status;
-            }
+            deadline=std::max(deadline, due)+p_conf.parameters.time_comparator;
+        }
+        if(deadline == old_deadline)
+        {
+            continue;
+        }
+        status=modify_config(TempMetricGroupTimesConfig_n, i, t_conf.data, sizeof(t_conf.parameters));
+        if(status != NODEFLOW_OK)
+        {
+            ErrorHandler(__LINE__,"TempMetricGroupTimesConfig_n",status,__PRETTY_FUNCTION__);
+            return status;
+        }
+    }
+    return NODEFLOW_OK;
+}
 
-            if(time_comp < 0)
-            { 
-                time_comp=sg_conf.parameters.time_comparator- time;
-                if(time_comp < 0 ) 
-                {
-                    time_comp=2;
-                }
-                temp_time[i]=time_comp;
-            }
-            else
-            {
-                temp_time[i]=sg_conf.parameters.time_comparator;
-            }
+int NodeFlow::build_event_table()
+{
+    EventConfig e_conf={};
+    uint16_t time=0;
+    uint16_t schedulerOn=0;
+    read_sched_config(0,schedulerOn);
+    if(schedulerOn)
+    {
+        uint16_t length=0;
+        uint16_t group_id=0;
+        read_sched_config(1,length);
+        for(int i=0; i<length; i++)
+        {
+            read_sched_config(i+2,time);
+            read_sched_group_id(i+2,group_id);
+            add_event(e_conf, time, group_id & EVENT_GROUPS);
         }
     }
 
-    for(int i=0; i<sch_length; i++)
+    /** Interval groups have a period in the metric group times */
+    TimeConfig p_conf;
+    for(uint8_t i=0; i<metric_group_count; i++)
     {
-        sg_conf.parameters.time_comparator=temp_time[i];
-        if(i == 0)
+        if(read_config(MetricGroupTimesConfig_n, i, p_conf.data, sizeof(p_conf.parameters)) == NODEFLOW_OK 
+           && p_conf.parameters.time_comparator != 0)
         {
-            status=DataManager::overwrite_file_entries(TempMetricGroupTimesConfig_n, sg_conf.data, sizeof(sg_conf.parameters)); 
-            if(status != NODEFLOW_OK)
-            {
-                ErrorHandler(__LINE__,"TempMetricGroupTimesConfig_n",status,__PRETTY_FUNCTION__);
-                return status;
-            }
+            e_conf.parameters.interval=true;
         }
-        else
+    }
+
+    uint16_t sendschedulerOn=0;
+    read_send_sched_config(0,sendschedulerOn);
+    if(sendschedulerOn)
+    {
+        uint16_t send_length=0;
+        read_send_sched_config(1,send_length);
+        for(int i=0; i<send_length; i++)
         {
-            status=DataManager::append_file_entry(TempMetricGroupTimesConfig_n, sg_conf.data, sizeof(sg_conf.parameters));
-            if(status != NODEFLOW_OK)
-            {   
-                ErrorHandler(__LINE__,"TempMetricGroupTimesConfig_n",status,__PRETTY_FUNCTION__);
-                return status;
-            }
+            read_send_sched_config(i+2,time);
+            add_event(e_conf, time, EVENT_SEND);
         }
     }
-   return status;
+
+    bool clockSynchOn=false;
+    read_clock_synch_config(time,clockSynchOn);
+    if(clockSynchOn)
+    {
+        add_event(e_conf, time, EVENT_CLOCK);
+    }
+
+    status=overwrite_config(EventConfig_n, e_conf.data, sizeof(e_conf.parameters));
+    if(status != NODEFLOW_OK)
+    {
+        ErrorHandler(__LINE__,"EventConfig",status,__PRETTY_FUNCTION__);
+    }
+    return status;
+}
+
+void NodeFlow::add_event(EventConfig& e_conf, uint16_t time, uint16_t mask)
+{
+    time=time%(DAYINSEC/2);
+    uint16_t* times=e_conf.parameters.time;
+    uint8_t& events=e_conf.parameters.events;
+    int i=std::lower_bound(times, times+events, time)-times;
+    if(i < events && times[i] == time)
+    {
+        e_conf.parameters.mask[i]|=mask;
+        return;
+    }
+    if(events == EVENT_TABLE_SIZE)
+    {
+        debug("\r\nEvent table full, %d s dropped",time*2);
+        return;
+    }
+    memmove(&times[i+1], &times[i], (events-i)*sizeof(times[0]));
+    memmove(&e_conf.parameters.mask[i+1], &e_conf.parameters.mask[i], (events-i)*sizeof(e_conf.parameters.mask[0]));
+    times[i]=time;
+    e_conf.parameters.mask[i]=mask;
+    events++;
 }
-int NodeFlow::overwrite_metric_flags(uint8_t ssck_flag)
+
+bool NodeFlow::next_event(uint32_t now, int latency, uint32_t& timediff, uint16_t& mask)
 {
-    MetricGroupConfig mg_conf;
-    mg_conf.parameters.metric_group_id=ssck_flag;
-    status=DataManager::overwrite_file_entries(MetricGroupConfig_n, mg_conf.data, sizeof(mg_conf.parameters));
+    timediff=DAYINSEC;
+    mask=0;
+    EventConfig e_conf;
+    status=read_config(EventConfig_n, 0, e_conf.data, sizeof(e_conf.parameters));
     if(status != NODEFLOW_OK)
-    {   
-        ErrorHandler(__LINE__,"MetricGroupConfig_n",status,__PRETTY_FUNCTION__);
+    {
+        ErrorHandler(__LINE__,"EventConfig",status,__PRETTY_FUNCTION__);
+        return false;
     }
-    return status;
+    uint8_t events=e_conf.parameters.events;
+    if(events == 0)
+    {
+        return e_conf.parameters.interval;
+    }
+    /** First event after the start of the wake, the day wraps to the first event */
+    now=now%DAYINSEC;
+    latency=std::max(std::min(latency, DAYINSEC-1), 0);
+    uint16_t start=((now+DAYINSEC-latency)%DAYINSEC)/2;
+    int i=std::upper_bound(e_conf.parameters.time, e_conf.parameters.time+events, start)-e_conf.parameters.time;
+    if(i == events)
+    {
+        i=0;
+    }
+    int32_t elapsed=(int32_t(e_conf.parameters.time[i])*2+DAYINSEC-(now+DAYINSEC-latency)%DAYINSEC)%DAYINSEC;
+    if(elapsed == 0)
+    {
+        elapsed=DAYINSEC;
+    }
+    timediff=std::max(elapsed-latency, int32_t(1));
+    mask=e_conf.parameters.mask[i];
+    return e_conf.parameters.interval;
+}
+
+int NodeFlow::overwrite_metric_flags(uint16_t ssck_flag)
+{
+    WakeStateConfig ws_conf;
+    status=read_wake_state(ws_conf);
+    if(status != NODEFLOW_OK)
+    {
+        return status;
+    }
+    ws_conf.parameters.metric_group_id=ssck_flag;
+    return overwrite_wake_state(ws_conf);
 }
 
-int NodeFlow::get_metric_flags(uint8_t &flag)
+int NodeFlow::get_metric_flags(uint16_t &flag)
 {
-    MetricGroupConfig mg_conf;
-    status=DataManager::read_file_entry(MetricGroupConfig_n, 0, mg_conf.data, sizeof(mg_conf.parameters));
+    WakeStateConfig ws_conf;
+    status=read_wake_state(ws_conf);
     if (status!=NODEFLOW_OK)
     {
-        ErrorHandler(__LINE__,"MetricGroupConfig_n",status,__PRETTY_FUNCTION__);
         return status;
     } 
-    flag=mg_conf.parameters.metric_group_id;
+    flag=ws_conf.parameters.metric_group_id;
     return status;
 }
 
@@ -1961,28 +2580,27 @@ int NodeFlow::get_metric_flags(uint8_t &flag)
 
 int NodeFlow::get_interrupt_latency(uint32_t &next_sch_time)
 {
-    TimeConfig t_conf;
-    status=DataManager::read_file_entry(NextTimeConfig_n, 0, t_conf.data,sizeof(t_conf.parameters));
+    WakeStateConfig ws_conf;
+    status=read_wake_state(ws_conf);
     if (status != NODEFLOW_OK)
     {
-        ErrorHandler(__LINE__,"NextTimeConfig_n",status,__PRETTY_FUNCTION__);
         return status;
     }
-    next_sch_time=t_conf.parameters.time_comparator-time_now();
+    next_sch_time=ws_conf.parameters.next_time-time_now();
     return status;
 }
 
 int NodeFlow::overwrite_wakeup_timestamp(uint16_t time_remainder){
     
-    TimeConfig t_conf;
-    t_conf.parameters.time_comparator=time_now()+time_remainder;
-    status=DataManager::overwrite_file_entries( NextTimeConfig_n, t_conf.data, sizeof(t_conf.parameters));
+    WakeStateConfig ws_conf;
+    status=read_wake_state(ws_conf);
     if (status != NODEFLOW_OK)
     {   
-        ErrorHandler(__LINE__,"NextTimeConfig",status,__PRETTY_FUNCTION__);
+        return status;
     }
+    ws_conf.parameters.next_time=time_now()+time_remainder;
 
-    return status;
+    return overwrite_wake_state(ws_conf);
 }
 /** Timestamp. Send ClockSync message, wait for a response from ttn if it fails don't change the time
  * @param num_timestamp_retries  The number of retries to get the Timestamp
@@ -2017,72 +2635,21 @@ uint32_t NodeFlow::time_now()
 
 void NodeFlow::_sense()
 {
-    uint16_t sched_length, c_entries;
-    read_sched_config(1,sched_length);
-   
-    if (sched_length>1)
-    {   
-        uint8_t mg_flag;
-        get_metric_flags(mg_flag);
-        bitset<8> metric_flag(mg_flag);
-    
-        debug("\r\nMGroupA: %d, MGroupB: %d, MGroupC: %d, MGroupC: %d",metric_flag.test(0),
-                metric_flag.test(1),metric_flag.test(2),metric_flag.test(3));
-       
-        
-        if(metric_flag.test(0)==1)
-        {
-            MetricGroupA();
-            tformatter.get_entries(c_entries);
-            if( c_entries>1)
-            {
-                increase_mg_entries_counter(1);
-            }
-            add_payload_data(1);
-        }
-
-        if(metric_flag.test(1)==1)
-        {
-            MetricGroupB();
-            tformatter.get_entries(c_entries);
-            if( c_entries>1)
-            {
-                increase_mg_entries_counter(2);
-            }
-            add_payload_data(2);
-        }
-        if(metric_flag.test(2)==1)
-        {   
-            MetricGroupC();
-            uint16_t c_entries;
-            tformatter.get_entries(c_entries);
-            if( c_entries>1)
-            {
-                increase_mg_entries_counter(3);
-            }
-            add_payload_data(3);
-        }
-        if(metric_flag.test(3)==1)
-        {
-            MetricGroupD();
-            tformatter.get_entries(c_entries);
-            if( c_entries>1)
-            {
-                increase_mg_entries_counter(4);
-            }
-            add_payload_data(4);
-        }
-    }
-    else
+    uint16_t mg_flag=0, c_entries;
+    get_metric_flags(mg_flag);
+    phase_end(PHASE_WAKE);
+    for(uint8_t i=0; i<metric_group_count; i++)
     {
-
-        MetricGroupA();
-        tformatter.get_entries(c_entries);
-        if( c_entries>1)
+        if(!(mg_flag & (1<<i)))
         {
-            increase_mg_entries_counter(1);
+            continue;
         }
-        add_payload_data(1);
+        debug("\r\nMGroup: %d",i+1);
+        sensing_group=i+1;
+        phase_begin();
+        metric_groups[i].sense();
+        phase_end(PHASE_SENSE);
+        add_payload_data(sensing_group);
     }
  
     is_overflow();
@@ -2090,41 +2657,297 @@ void NodeFlow::_sense()
 }
 
 
-void NodeFlow::read_write_entry(uint8_t group_tag, int start_len, int end_len, uint8_t filename)
+/** Reads a contiguous span of a metric group file. Every chunk of the span is read with a single
+ *  transaction, the bytes after the last full chunk come from the tail record.
+ */
+int NodeFlow::read_mg_span(uint8_t filename, int start, int& length, uint8_t* data, int& total_bytes)
 {
-    if (end_len!=0)
+    DataTailConfig tail_conf;
+    status=read_mg_tail(tail_conf);
+    if(status != NODEFLOW_OK)
     {
-        if(start_len==0)
-        {
-            tformatter.write(group_tag, TFormatter::GROUP_TAG); 
-            tformatter.write(159, TFormatter::RAW);
-        }
-        else
-        {
-            tformatter.decrease_entries();
-        }
-        int i=start_len;
-        for (i=start_len; i<end_len; i++) 
-        {   
-            DataConfig d_conf;
-            DataManager::read_file_entry(filename, i, d_conf.data, sizeof(d_conf.parameters));
-            tformatter.write(d_conf.parameters.byte, TFormatter::RAW);
-
-        }
-        int total_bytes=0;
-        status= DataManager::get_total_written_file_entries(filename, total_bytes);
-        if(status != NODEFLOW_OK)
+        return status;
+    }
+    PoolConfig pool_conf;
+    status=read_pool(pool_conf);
+    if(status != NODEFLOW_OK)
+    {
+        return status;
+    }
+    uint8_t metric_group=get_mg_group(filename);
+    status=get_mg_file_bytes(filename, tail_conf, total_bytes);
+    if(status != NODEFLOW_OK)
+    {
+        return status;
+    }
+    int file_bytes=total_bytes-tail_conf.parameters.group[metric_group].length;
+    length=std::max(std::min(length, total_bytes-start), 0);
+
+    int done=0;
+    while(done<length)
+    {
+        int pos=start+done;
+        if(pos<file_bytes)
+        {
+            int chunk=tail_conf.parameters.group[metric_group].first+pos/DATA_CHUNK_SIZE;
+            uint8_t extent=get_mg_extent(pool_conf, metric_group, chunk/POOL_EXTENT_CHUNKS);
+            DataConfig d_conf;
+            status=DataManager::read_file_entry(MetricPoolConfig_n+extent, chunk%POOL_EXTENT_CHUNKS, d_conf.data, sizeof(d_conf.parameters));
+            eeprom_calls++;
+            if(status != NODEFLOW_OK)
+            {
+                ErrorHandler(__LINE__,"MetricGroupsConfig",status,__PRETTY_FUNCTION__);
+                return status;
+            }
+            int n=std::min(DATA_CHUNK_SIZE-(pos%DATA_CHUNK_SIZE), length-done);
+            memcpy(&data[done], &d_conf.parameters.byte[pos%DATA_CHUNK_SIZE], n);
+            done+=n;
+        }
+        else
+        {
+            memcpy(&data[done], &tail_conf.parameters.group[metric_group].byte[pos-file_bytes], length-done);
+            done=length;
+        }
+    }
+    return NODEFLOW_OK;
+}
+
+void NodeFlow::read_write_entry(uint8_t group_tag, bool first, int start_len, int end_len, uint8_t filename, int room, int& consumed)
+{
+    consumed=0;
+    status=NODEFLOW_OK;
+    if (end_len!=0)
+    {
+        if(first)
+        {
+            /** The tag goes with at least a record, the group starts in the next block */
+            if(room <= RECORD_BASE_SIZE)
+            {
+                return;
+            }
+            status=write_group_head(group_tag, filename);
+            if(status != NODEFLOW_OK)
+            {
+                return;
+            }
+            room-=RECORD_BASE_SIZE;
+        }
+        RecordWalk walk={};
+        status=parse_mg_records(filename, start_len, end_len, room, true, walk);
+        consumed=walk.consumed;
+        if(walk.skipped != 0)
         {
-            ErrorHandler(__LINE__,"get_total_written_file_entries",status,__PRETTY_FUNCTION__);
+            debug("\r\nGroup %d: %d corrupt bytes skipped",group_tag,walk.skipped);
         }
-        if (total_bytes==i)
+        if (status == NODEFLOW_OK && end_len==start_len+consumed)
         {
-             tformatter.write(255, TFormatter::RAW);
+            status=write_group_break();
         }
        
     }
 }
 
+int NodeFlow::write_group_head(uint8_t group_tag, uint8_t filename)
+{
+    DataTailConfig tail_conf;
+    status=read_mg_tail(tail_conf);
+    if(status != NODEFLOW_OK)
+    {
+        return status;
+    }
+    /** Tag, 0x9F, base time and the break byte */
+    if(tx_length+RECORD_BASE_SIZE+3 > TP_TX_BUFFER)
+    {
+        return TX_BUFFER_FULL;
+    }
+    tformatter.write(group_tag, TFormatter::GROUP_TAG); 
+    tx_append_formatter();
+    tx_buffer[tx_length++]=159;
+    tx_length+=cbor_int(tail_conf.parameters.group[get_mg_group(filename)].base_time, &tx_buffer[tx_length]);
+    return NODEFLOW_OK;
+}
+
+int NodeFlow::write_group_break()
+{
+    if(tx_length >= TP_TX_BUFFER)
+    {
+        return TX_BUFFER_FULL;
+    }
+    tx_buffer[tx_length++]=255;
+    return NODEFLOW_OK;
+}
+
+int NodeFlow::parse_mg_records(uint8_t filename, int start, int end, int room, bool write, RecordWalk& walk)
+{
+    int pos=start;
+    walk.consumed=0;
+    walk.output=0;
+    if(start == 0)
+    {
+        record_window_length=0;
+    }
+    bool full=false;
+    while (pos<end && !full) 
+    {   
+        int length=std::min(end-pos, int(sizeof(span_buffer)));
+        status=read_mg_span(filename, pos, length, span_buffer, walk.total_bytes);
+        if(status != NODEFLOW_OK)
+        {
+            return status;
+        }
+        if(length == 0)
+        {
+            break;
+        }
+
+        /** Nothing is stored after the last span, a record that doesn't fit in it is corrupt */
+        bool last=(pos+length == walk.total_bytes);
+        int p=0;
+        while (p<length)
+        {
+            uint8_t record_length=span_buffer[p] & ~RECORD_COMPRESSED;
+            bool fits=(p+RECORD_HEADER_SIZE+record_length <= length);
+            if(!fits && !last && record_length != 0 && record_length <= MAX_RECORD_SIZE)
+            {
+                break;
+            }
+            bool valid=(fits && record_length != 0 && record_length <= MAX_RECORD_SIZE);
+            if(valid)
+            {
+                uint16_t crc;
+                memcpy(&crc, &span_buffer[p+1], sizeof(crc));
+                valid=(crc == crc16((char*)&span_buffer[p+RECORD_HEADER_SIZE], record_length, crc16((char*)&span_buffer[p], 1)));
+            }
+            if(!valid)
+            {
+                p++;
+                walk.skipped++;
+                continue;
+            }
+
+            uint8_t* payload=&span_buffer[p+RECORD_HEADER_SIZE];
+            uint8_t decoded[MAX_RECORD_SIZE];
+            int payload_length=record_length;
+            bool compressed=(span_buffer[p] & RECORD_COMPRESSED);
+            if(compressed)
+            {
+                payload_length=decompress_record(payload, record_length, decoded);
+                if(payload_length < 0)
+                {
+                    /** Its key frame is lost, the record is dropped whole */
+                    p+=RECORD_HEADER_SIZE+record_length;
+                    walk.skipped+=RECORD_HEADER_SIZE+record_length;
+                    walk.lost++;
+                    continue;
+                }
+                payload=decoded;
+            }
+            if(room >= 0 && walk.output+payload_length > room)
+            {
+                full=true;
+                break;
+            }
+            if(!compressed)
+            {
+                walk.keyframe=pos+p;
+                memcpy(record_window, payload, record_length);
+                record_window_length=record_length;
+                memcpy(&record_window_crc, &span_buffer[p+1], sizeof(record_window_crc));
+            }
+            if(write)
+            {
+                memcpy(&tx_buffer[tx_length], payload, payload_length);
+                tx_length+=payload_length;
+            }
+            walk.output+=payload_length;
+            walk.records++;
+            p+=RECORD_HEADER_SIZE+record_length;
+        }
+        if(p == 0)
+        {
+            break;
+        }
+        pos+=p;
+    }
+    walk.consumed=pos-start;
+    return NODEFLOW_OK;
+}
+
+/** Only the bytes after the checkpoint of a group are walked, they are the ones appended without their tail
+ *  write. A clean boot reads no record.
+ */
+int NodeFlow::scan_mg_records()
+{
+    for(uint8_t i=0; i<METRIC_GROUP_FILES; i++)
+    {
+        uint8_t filename=get_mg_filename(i);
+        if(filename == 0)
+        {
+            continue;
+        }
+        DataTailConfig tail_conf;
+        status=read_mg_tail(tail_conf);
+        if(status != NODEFLOW_OK)
+        {
+            return status;
+        }
+        PoolConfig pool_conf;
+        status=read_pool(pool_conf);
+        if(status != NODEFLOW_OK)
+        {
+            return status;
+        }
+        int chunks=0;
+        status=get_mg_chunks(i, pool_conf, chunks);
+        if(status != NODEFLOW_OK)
+        {
+            return status;
+        }
+        DataTail& tail=tail_conf.parameters.group[i];
+        if(chunks > tail.chunks)
+        {
+            /** Reset after a chunk was appended, before the tail was written. Its bytes are in the chunk, the
+             *  record being written is cut and skipped by its CRC. */
+            debug("\r\nGroup %d: tail of %d bytes already appended",i,tail.length);
+            tail.length=0;
+            tail.chunks=chunks;
+        }
+        int bytes=0;
+        status=get_mg_file_bytes(filename, tail_conf, bytes);
+        if(status != NODEFLOW_OK)
+        {
+            return status;
+        }
+        if(tail.checked == bytes)
+        {
+            continue;
+        }
+        /** A checkpoint past the bytes stored is wrong, the group is counted again from its first byte. The key 
+         *  frame before the checkpoint isn't read, a record compressed against it is still stored. */
+        if(tail.checked > bytes)
+        {
+            tail.checked=0;
+            tail.records=0;
+        }
+        RecordWalk walk={};
+        record_window_length=0;
+        status=parse_mg_records(filename, tail.checked, bytes, -1, false, walk);
+        if(status != NODEFLOW_OK)
+        {
+            return status;
+        }
+        debug("\r\nGroup %d: %d records from byte %d, %d bytes stored",i,walk.records+walk.lost,tail.checked,bytes);
+        tail.records+=walk.records+walk.lost;
+        tail.checked=bytes;
+        status=overwrite_mg_tail(tail_conf);
+        if(status != NODEFLOW_OK)
+        {
+            return status;
+        }
+    }
+    return NODEFLOW_OK;
+}
+
 void NodeFlow::UploadNow()
 {
    
@@ -2133,368 +2956,1508 @@ void NodeFlow::UploadNow()
 
 int NodeFlow::_send()
 {
-    uint16_t mga_entries, mgb_entries, mgc_entries, mgd_entries, interrupt_entries;
-    int mga_bytes, mgb_bytes, mgc_bytes, mgd_bytes, interrupt_bytes;
+    /** The urgent records don't wait behind the backlog */
+    status=_send_urgent();
+    if(status != NODEFLOW_OK)
+    {
+        return status;
+    }
+    return send_upload();
+}
+
+int NodeFlow::send_upload()
+{
+    SendCursorConfig c_conf;
+    status=read_send_cursor(c_conf);
+    if(status != NODEFLOW_OK)
+    {
+        return status;
+    }
+    if(!c_conf.parameters.open)
+    {
+        status=begin_upload(c_conf);
+        if(status != NODEFLOW_OK || !c_conf.parameters.open)
+        {
+            return status;
+        }
+    }
     uint8_t metric_group_active=0;
+    for(uint8_t i=0; i<METRIC_GROUP_FILES; i++)
+    {
+        debug("\r\nGroup %d: ENTRIES %d, BYTES %d",i,c_conf.parameters.entries[i],c_conf.parameters.bytes[i]);
+        metric_group_active+=(c_conf.parameters.entries[i] != 0);
+    }
 
-    read_mg_entries_counter(mga_entries, mgb_entries, mgc_entries, mgd_entries, interrupt_entries, metric_group_active);
-    read_mg_bytes(mga_bytes, mgb_bytes, mgc_bytes, mgd_bytes, interrupt_bytes); 
-   
-    uint32_t total_bytes = mga_bytes+ mgb_bytes+ mgc_bytes+ mgd_bytes+interrupt_bytes;
-    size_t buffer_len=0;
-    send_block_number=0;
-    debug("\r\nENTRIES = MGA: %d, MGB: %d, MGC: %d, MGD: %d, MGI: %d",mga_entries, mgb_entries, mgc_entries, mgd_entries,interrupt_entries);
-    debug("\r\nBYTES = MGA: %d, MGB: %d, MGC: %d, MGD: %d, MGI: %d",mga_bytes, mgb_bytes, mgc_bytes, mgd_bytes, interrupt_bytes);
-    if(total_bytes != 0)
+    if(c_conf.parameters.total_blocks == 0)
     {
-        tformatter.serialise_main_cbor_object(metric_group_active);
+        /** The packing is the same on every pass, the blocks counted are the blocks sent */
+        status=divide_upload(c_conf, metric_group_active, true);
+        if(status != NODEFLOW_OK)
+        {
+            return status;
+        }
+        c_conf.parameters.total_blocks=send_block_number;
+        status=overwrite_send_cursor(c_conf);
+        if(status != NODEFLOW_OK)
+        {
+            return status;
+        }
+        debug("\r\nUpload of %d blocks",c_conf.parameters.total_blocks);
+    }
+    total_blocks=c_conf.parameters.total_blocks;
+    if(c_conf.parameters.block != 0)
+    {
+        debug("\r\nUpload resumed at block %d, group %d byte %d",c_conf.parameters.block,c_conf.parameters.group,c_conf.parameters.done);
+    }
+    status=divide_upload(c_conf, metric_group_active, false);
+    if (status < NODEFLOW_OK)
+    {
+        debug("\r\nLine %d",__LINE__);
+        return status;
+    }
+
+    /** Acknowledgements of earlier blocks can come with the downlink of a later one */
+    UploadAckConfig a_conf;
+    status=read_upload_acks(a_conf);
+    if (status != NODEFLOW_OK)
+    {
+        return status;
+    }
+    for(uint16_t block=0; block<send_block_number; block++)
+    {
+        if(is_block_acked(a_conf, block))
+        {
+            continue;
+        }
+        /** The network server may not acknowledge at all, the upload is given up after its retries */
+        if(++c_conf.parameters.retries < UPLOAD_ACK_RETRIES)
+        {
+            debug("\r\nBlock %d of %d not delivered, the upload stays open",block,send_block_number);
+            status=overwrite_send_cursor(c_conf);
+            return (status == NODEFLOW_OK) ? SEND_FAILED : status;
+        }
+        debug("\r\nBlock %d of %d not acknowledged after %d uploads, taken as delivered",block,send_block_number,UPLOAD_ACK_RETRIES);
+        break;
+    }
+    status=clear_after_send();
+    if (status != NODEFLOW_OK)
+    {
+        return status;
+    }
     
-        uint16_t available=0;
+   return NodeFlow::NODEFLOW_OK;
+}
 
-        tformatter.get_entries(available);
+int NodeFlow::divide_upload(SendCursorConfig& c_conf, uint8_t metric_group_active, bool count)
+{
+    counting_blocks=count;
+    send_block_number=c_conf.parameters.block;
+    upload_gap=false;
+    tx_length=0;
+    if(send_block_number == 0)
+    {
+        tformatter.serialise_main_cbor_object(metric_group_active);
+        tx_append_formatter();
+    }
+    uint16_t available=0;
 
-        total_blocks=ceil((available+total_bytes)/TP_TX_BUFFER);
-        
-        available=TP_TX_BUFFER-available;
-        
-        #if (INTERRUPT_ON)
-            status=_divide_to_blocks(5, InterruptConfig_n, interrupt_bytes, available);
-            if (status < NODEFLOW_OK)
+    uint8_t order[METRIC_GROUP_FILES];
+    get_send_order(order);
+    status=NODEFLOW_OK;
+    for(uint8_t n=get_send_position(order, c_conf.parameters.group); n<METRIC_GROUP_FILES && status >= NODEFLOW_OK; n++)
+    {
+        uint8_t i=order[n];
+        uint8_t filename=get_mg_filename(i);
+        uint8_t tag=(i == 0) ? INTERRUPT_GROUP_TAG : i;
+        if(filename == 0)
+        {
+            continue;
+        }
+        /** The group is counted in the main object, it closes empty in the last block. So does the group the
+         *  upload was cut in if none of its records made it */
+        uint8_t cut=c_conf.parameters.cut;
+        if(cut != UPLOAD_UNCUT && (n > get_send_position(order, cut) || 
+           (i == cut && c_conf.parameters.bytes[i] == c_conf.parameters.skip[i])))
+        {
+            if(c_conf.parameters.entries[i] != 0)
             {
-                return status;
+                status=write_group_head(tag, filename);
+                if(status == NODEFLOW_OK)
+                {
+                    status=write_group_break();
+                }
             }
-        #endif
-        
-        status=_divide_to_blocks(1, MetricGroupAConfig_n, mga_bytes, available);
-        if (status < NODEFLOW_OK)
+            continue;
+        }
+        status=_divide_to_blocks(tag, filename, c_conf, available);
+    }
+    if(status >= NODEFLOW_OK)
+    {
+        status=_send_blocks(true);
+    }
+    counting_blocks=false;
+    return status;
+}
+
+#if BOARD == EARHART_V1_0_0
+    static constexpr uint8_t lorawan_max_payloads[]=LORAWAN_MAX_PAYLOADS;
+    static_assert(LORAWAN_DATA_RATE >= 0 && LORAWAN_DATA_RATE < sizeof(lorawan_max_payloads), 
+                  "LORAWAN_DATA_RATE is a rate of LORAWAN_MAX_PAYLOADS");
+#endif /* #if BOARD == EARHART_V1_0_0 */
+
+uint16_t NodeFlow::get_block_size()
+{
+    #if BOARD == EARHART_V1_0_0
+        return std::min(uint16_t(lorawan_max_payloads[LORAWAN_DATA_RATE]), uint16_t(TP_TX_BUFFER));
+    #endif /* #if BOARD == EARHART_V1_0_0 */
+    return TP_TX_BUFFER;
+}
+
+uint8_t NodeFlow::get_groups_after(const SendCursorConfig& c_conf, uint8_t metric_group)
+{
+    uint8_t order[METRIC_GROUP_FILES];
+    get_send_order(order);
+    uint8_t groups=0;
+    for(uint8_t n=get_send_position(order, metric_group)+1; n<METRIC_GROUP_FILES; n++)
+    {
+        groups+=(get_mg_filename(order[n]) != 0 && c_conf.parameters.entries[order[n]] != 0);
+    }
+    return groups;
+}
+
+int NodeFlow::_divide_to_blocks(uint8_t group, uint8_t filename, SendCursorConfig& c_conf, uint16_t&available)
+{
+    uint8_t metric_group=get_mg_group(filename);
+    uint16_t skip=c_conf.parameters.skip[metric_group];
+    uint16_t buffer_len=c_conf.parameters.bytes[metric_group];
+    uint16_t done=(c_conf.parameters.group == metric_group) ? std::max(c_conf.parameters.done, skip) : skip;
+
+    /** A resumed upload walks the records already sent to find the key frame of the next one, the records 
+     *  carried over by a cut upload find theirs in the skipped bytes */
+    record_window_length=0;
+    if(done > 0)
+    {
+        RecordWalk walk={};
+        parse_mg_records(filename, 0, done, -1, false, walk);
+    }
+    
+    uint16_t block_size=get_block_size();
+    while(done<buffer_len)
+    {   
+        /** The group tag, 0x9F and the break byte are written around the records. The last block of the upload
+         *  keeps room for the head and break of this group, if it starts in it, and of the ones after it to 
+         *  close empty. */
+        bool last=(send_block_number >= UPLOAD_MAX_BLOCKS-1);
+        uint16_t reserve=3;
+        if(last)
+        {
+            reserve+=(get_groups_after(c_conf, metric_group)+(done == skip))*(RECORD_BASE_SIZE+3);
+        }
+        uint16_t entries=tx_length;
+        available=(entries+reserve < block_size) ? block_size-entries-reserve : 0;
+        int consumed=0;
+        read_write_entry(group, done == skip, done, buffer_len, filename, available, consumed);
+        if (status != NODEFLOW_OK)
         {
             return status;
         }
-        
-        #if (SCHEDULER_B || METRIC_GROUPS_ON==2 || METRIC_GROUPS_ON==3 || METRIC_GROUPS_ON==4)
-            status=_divide_to_blocks(2, MetricGroupBConfig_n, mgb_bytes, available);
-            if (status < NODEFLOW_OK)
+        if (consumed == 0 && entries == 0)
+        {
+            /** The upload waits for a data rate that takes the record, it isn't released unsent */
+            debug("\r\nGroup %d: the next record doesn't fit a block of %d bytes",group,block_size);
+            return SEND_FAILED;
+        }
+        done += consumed;
+        if (done < buffer_len && last)
+        {
+            /** The records left are carried over to the next upload */
+            debug("\r\nUpload cut at %d blocks, group %d byte %d",UPLOAD_MAX_BLOCKS,metric_group,done);
+            if(done == skip && tx_length == entries)
+            {
+                status=write_group_head(group, filename);
+                if (status != NODEFLOW_OK)
+                {
+                    return status;
+                }
+            }
+            status=write_group_break();
+            if (status != NODEFLOW_OK)
             {
                 return status;
             }
-        #endif /*  #if (SCHEDULER_B || METRIC_GROUPS_ON==2) */
-
-        #if (SCHEDULER_C || METRIC_GROUPS_ON==3 || METRIC_GROUPS_ON==4)
-            status=_divide_to_blocks(3, MetricGroupCConfig_n, mgc_bytes, available);
+            c_conf.parameters.bytes[metric_group]=done;
+            c_conf.parameters.cut=metric_group;
+            return overwrite_send_cursor(c_conf);
+        }
+        if (done < buffer_len)
+        {
+            status=_send_blocks(false);
             if (status < NODEFLOW_OK)
             {
+                debug("\r\nLine %d",__LINE__);
                 return status;
             }
-        #endif /*  #if (SCHEDULER_C|| METRIC_GROUPS_ON==3) */
-        
-        #if (SCHEDULER_D || METRIC_GROUPS_ON==4)
-            status=_divide_to_blocks(4, MetricGroupDConfig_n, mgd_bytes, available);
+            if(upload_gap || counting_blocks)
+            {
+                continue;
+            }
+            /** The next block starts here */
+            c_conf.parameters.group=metric_group;
+            c_conf.parameters.done=done;
+            c_conf.parameters.block=send_block_number;
+            status=overwrite_send_cursor(c_conf);
             if (status < NODEFLOW_OK)
             {
                 return status;
             }
-        #endif /*  #if (SCHEDULER_C|| METRIC_GROUPS_ON==4) */
-        
-        status=_send_blocks();
-        if (status < NODEFLOW_OK)
-        {
-            debug("\r\nLine %d",__LINE__);
-            return status;
         }
     }
-    
-   return NodeFlow::NODEFLOW_OK;
+    return NodeFlow::NODEFLOW_OK;
 }
 
-int NodeFlow::_divide_to_blocks(uint8_t group, uint8_t filename, uint16_t buffer_len, uint16_t&available)
+int NodeFlow::begin_upload(SendCursorConfig& c_conf)
 {
-    uint16_t entries=0;
-    uint16_t done=0;
-    tformatter.get_entries(entries);
-    available=TP_TX_BUFFER-entries;
-    
-    if(buffer_len!=0)
+    uint16_t entries[METRIC_GROUP_FILES];
+    int bytes[METRIC_GROUP_FILES];
+    uint8_t metric_group_active=0;
+    read_mg_entries_counter(entries, metric_group_active);
+    status=read_mg_bytes(bytes);
+    if(status != NODEFLOW_OK)
     {
-        done=0;
-        while(done<buffer_len)
-        {   
-            
-            if (available>TP_TX_BUFFER)
-            {
-                available = TP_TX_BUFFER;
-            }
-            if(buffer_len<available)
+        return status;
+    }
+    DataTailConfig tail_conf;
+    status=read_mg_tail(tail_conf);
+    if(status != NODEFLOW_OK)
+    {
+        return status;
+    }
+
+    bool data=false;
+    for(uint8_t i=0; i<METRIC_GROUP_FILES; i++)
+    {
+        bool urgent=(get_mg_filename(i) == 0 || get_mg_priority(i) == SEND_PRIORITY_URGENT);
+        c_conf.parameters.bytes[i]=urgent ? 0 : bytes[i];
+        c_conf.parameters.entries[i]=urgent ? 0 : entries[i];
+        data|=(c_conf.parameters.bytes[i] > c_conf.parameters.skip[i]);
+        tail_conf.parameters.group[i].keyframe_length=0;
+    }
+    if(!data)
+    {
+        return NODEFLOW_OK;
+    }
+    status=overwrite_mg_tail(tail_conf);
+    if(status != NODEFLOW_OK)
+    {
+        return status;
+    }
+    status=clear_block_acks(0);
+    if(status != NODEFLOW_OK)
+    {
+        return status;
+    }
+    uint8_t order[METRIC_GROUP_FILES];
+    get_send_order(order);
+    c_conf.parameters.group=order[0];
+    c_conf.parameters.done=0;
+    c_conf.parameters.block=0;
+    c_conf.parameters.cut=UPLOAD_UNCUT;
+    c_conf.parameters.total_blocks=0;
+    c_conf.parameters.retries=0;
+    c_conf.parameters.open=true;
+    return overwrite_send_cursor(c_conf);
+}
+
+int NodeFlow::_send_urgent()
+{
+    for(uint8_t i=0; i<METRIC_GROUP_FILES; i++)
+    {
+        uint8_t filename=get_mg_filename(i);
+        if(filename == 0 || get_mg_priority(i) != SEND_PRIORITY_URGENT)
+        {
+            continue;
+        }
+        status=send_urgent_group(i, filename);
+        if(status != NODEFLOW_OK)
+        {
+            return status;
+        }
+    }
+    return NODEFLOW_OK;
+}
+
+int NodeFlow::send_urgent_group(uint8_t metric_group, uint8_t filename)
+{
+    SendCursorConfig c_conf;
+    status=read_send_cursor(c_conf);
+    if(status != NODEFLOW_OK)
+    {
+        return status;
+    }
+    int bytes[METRIC_GROUP_FILES];
+    status=read_mg_bytes(bytes);
+    if(status != NODEFLOW_OK)
+    {
+        return status;
+    }
+
+    /** The block numbers of the open upload are kept for its next block */
+    uint8_t block=send_block_number;
+    uint8_t blocks=total_blocks;
+    bool gap=upload_gap;
+    upload_gap=false;
+    urgent_upload=true;
+    send_block_number=0;
+    total_blocks=1;
+
+    int stored=bytes[metric_group];
+    uint16_t& skip=c_conf.parameters.skip[metric_group];
+    while(skip < stored && status == NODEFLOW_OK)
+    {
+        tx_length=0;
+        tformatter.serialise_main_cbor_object(1);
+        tx_append_formatter();
+        uint16_t block_size=get_block_size();
+        uint16_t available=(tx_length+3 < block_size) ? block_size-tx_length-3 : 0;
+        int consumed=0;
+        record_window_length=0;
+        read_write_entry((metric_group == 0) ? INTERRUPT_GROUP_TAG : metric_group, true, skip, stored, filename, 
+                         available, consumed);
+        if(status != NODEFLOW_OK)
+        {
+            break;
+        }
+        if(consumed == 0)
+        {
+            debug("\r\nGroup %d: the next record doesn't fit a block of %d bytes",metric_group,block_size);
+            break;
+        }
+        status=clear_block_acks(URGENT_ACK_BLOCK);
+        if(status != NODEFLOW_OK)
+        {
+            break;
+        }
+        send_block_number=0;
+        status=_send_blocks(true);
+        if(status != NODEFLOW_OK)
+        {
+            break;
+        }
+        if(upload_gap)
+        {
+            debug("\r\nUrgent uplink of group %d not delivered",metric_group);
+            status=SEND_FAILED;
+            break;
+        }
+
+        DataTailConfig tail_conf;
+        status=read_mg_tail(tail_conf);
+        if(status != NODEFLOW_OK)
+        {
+            break;
+        }
+        PoolConfig pool_conf;
+        status=read_pool(pool_conf);
+        if(status != NODEFLOW_OK)
+        {
+            break;
+        }
+        int sent=skip+consumed;
+        uint16_t left=stored-sent;
+        journal_begin();
+        release_mg_bytes(metric_group, pool_conf, tail_conf, sent, stored, skip);
+        stored=skip+left;
+        if(left == 0)
+        {
+            uint16_t sent_entries[METRIC_GROUP_FILES]={};
+            sent_entries[metric_group]=UINT16_MAX;
+            clear_mg_counter(tail_conf, sent_entries);
+        }
+        status=overwrite_send_cursor(c_conf);
+        if(status == NODEFLOW_OK)
+        {
+            status=overwrite_mg_tail(tail_conf);
+        }
+        if(status == NODEFLOW_OK)
+        {
+            status=overwrite_pool(pool_conf);
+        }
+        if(status != NODEFLOW_OK)
+        {
+            journal_abort();
+            break;
+        }
+        status=journal_commit();
+    }
+
+    urgent_upload=false;
+    send_block_number=block;
+    total_blocks=blocks;
+    upload_gap=gap;
+    tx_length=0;
+    return status;
+}
+
+bool NodeFlow::is_urgent_pending()
+{
+    int bytes[METRIC_GROUP_FILES];
+    SendCursorConfig c_conf;
+    if(read_mg_bytes(bytes) != NODEFLOW_OK || read_send_cursor(c_conf) != NODEFLOW_OK)
+    {
+        return false;
+    }
+    for(uint8_t i=0; i<METRIC_GROUP_FILES; i++)
+    {
+        if(get_mg_filename(i) != 0 && get_mg_priority(i) == SEND_PRIORITY_URGENT && bytes[i] > c_conf.parameters.skip[i])
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool NodeFlow::is_deadline_due()
+{
+    DataTailConfig tail_conf;
+    if(read_mg_tail(tail_conf) != NODEFLOW_OK)
+    {
+        return false;
+    }
+    uint32_t now=time(NULL);
+    for(uint8_t i=1; i<=metric_group_count; i++)
+    {
+        uint32_t deadline=metric_groups[i-1].deadline;
+        uint32_t base_time=tail_conf.parameters.group[i].base_time;
+        if(deadline != 0 && base_time != 0 && now >= base_time+deadline)
+        {
+            debug("\r\nGroup %d is past its deadline",i);
+            return true;
+        }
+    }
+    return false;
+}
+
+void NodeFlow::get_send_order(uint8_t* order)
+{
+    for(uint8_t i=0; i<METRIC_GROUP_FILES; i++)
+    {
+        uint8_t n=i;
+        uint8_t priority=(get_mg_filename(i) == 0) ? SEND_PRIORITY_BULK : get_mg_priority(i);
+        for(; n>0; n--)
+        {
+            uint8_t before=(get_mg_filename(order[n-1]) == 0) ? SEND_PRIORITY_BULK : get_mg_priority(order[n-1]);
+            if(before <= priority)
+            {
+                break;
+            }
+            order[n]=order[n-1];
+        }
+        order[n]=i;
+    }
+}
+
+uint8_t NodeFlow::get_send_position(const uint8_t* order, uint8_t metric_group)
+{
+    uint8_t n=0;
+    while(n < METRIC_GROUP_FILES-1 && order[n] != metric_group)
+    {
+        n++;
+    }
+    return n;
+}
+
+int NodeFlow::read_send_cursor(SendCursorConfig& c_conf)
+{
+    status=read_config(SendCursorConfig_n, 0, c_conf.data, sizeof(c_conf.parameters));
+    if(status != NODEFLOW_OK)
+    {
+        ErrorHandler(__LINE__,"SendCursorConfig",status,__PRETTY_FUNCTION__);
+    }
+    return status;
+}
+
+int NodeFlow::overwrite_send_cursor(SendCursorConfig& c_conf)
+{
+    status=overwrite_config(SendCursorConfig_n, c_conf.data, sizeof(c_conf.parameters));
+    if(status != NODEFLOW_OK)
+    {
+        ErrorHandler(__LINE__,"SendCursorConfig",status,__PRETTY_FUNCTION__);
+    }
+    return status;
+}
+int NodeFlow::read_upload_acks(UploadAckConfig& a_conf)
+{
+    status=read_config(UploadAckConfig_n, 0, a_conf.data, sizeof(a_conf.parameters));
+    if(status != NODEFLOW_OK)
+    {
+        ErrorHandler(__LINE__,"UploadAckConfig",status,__PRETTY_FUNCTION__);
+    }
+    return status;
+}
+
+int NodeFlow::overwrite_upload_acks(UploadAckConfig& a_conf)
+{
+    status=overwrite_config(UploadAckConfig_n, a_conf.data, sizeof(a_conf.parameters));
+    if(status != NODEFLOW_OK)
+    {
+        ErrorHandler(__LINE__,"UploadAckConfig",status,__PRETTY_FUNCTION__);
+    }
+    return status;
+}
+
+bool NodeFlow::is_block_acked(const UploadAckConfig& a_conf, uint16_t block)
+{
+    if(block == URGENT_ACK_BLOCK)
+    {
+        return a_conf.parameters.urgent;
+    }
+    return a_conf.parameters.acked[block/8] & (1 << (block%8));
+}
+
+int NodeFlow::mark_block_acked(uint16_t block)
+{
+    UploadAckConfig a_conf;
+    status=read_upload_acks(a_conf);
+    if(status != NODEFLOW_OK || is_block_acked(a_conf, block))
+    {
+        return status;
+    }
+    if(block == URGENT_ACK_BLOCK)
+    {
+        a_conf.parameters.urgent=true;
+    }
+    else
+    {
+        a_conf.parameters.acked[block/8]|=(1 << (block%8));
+    }
+    return overwrite_upload_acks(a_conf);
+}
+
+int NodeFlow::clear_block_acks(uint16_t block)
+{
+    UploadAckConfig a_conf;
+    status=read_upload_acks(a_conf);
+    if(status != NODEFLOW_OK)
+    {
+        return status;
+    }
+    if(block == URGENT_ACK_BLOCK)
+    {
+        a_conf.parameters.urgent=false;
+        return overwrite_upload_acks(a_conf);
+    }
+    for(uint16_t i=block; i<UPLOAD_MAX_BLOCKS; i++)
+    {
+        a_conf.parameters.acked[i/8]&=~(1 << (i%8));
+    }
+    return overwrite_upload_acks(a_conf);
+}
+
+void NodeFlow::tx_append_formatter()
+{
+    size_t length=0;
+    tformatter.get_serialised(&tx_buffer[tx_length], length);
+    tx_length+=length;
+}
+
+int NodeFlow::_send_blocks(bool last_block)
+{
+    uint8_t send_more_block=!last_block;
+    size_t buffer_len=tx_length;
+    tx_length=0;
+    if(counting_blocks)
+    {
+        send_block_number++;
+        return NODEFLOW_OK;
+    }
+
+    ack_block=urgent_upload ? URGENT_ACK_BLOCK : send_block_number;
+    UploadAckConfig a_conf;
+    status=read_upload_acks(a_conf);
+    if (status != NODEFLOW_OK)
+    {
+        return status;
+    }
+    if(is_block_acked(a_conf, ack_block))
+    {
+        debug("\r\nBlock %d already delivered",send_block_number);
+        send_block_number++;
+        return NODEFLOW_OK;
+    }
+
+    debug("\r\nSending %d bytes, msg: %d, more_block: %d",buffer_len, send_block_number,send_more_block);
+    int response_code=-1;
+    
+    #if BOARD == WRIGHT_V1_0_0
+        status=_radio.coap_post(tx_buffer, buffer_len, recv_data, SaraN2::TEXT_PLAIN, send_block_number,
+                                send_more_block, response_code);
+        if(status!=NODEFLOW_OK)
+        {
+            debug("\r\nUnsuccess..");
+            return SEND_FAILED;
+        }
+        if(response_code == 0 || response_code == 2) 
+        {
+            status=mark_block_acked(ack_block);
+            if (status != NODEFLOW_OK)
+            {
+                return status;
+            }
+        }
+        
+    #endif /* BOARD == WRIGHT_V1_0_0 */
+
+    #if BOARD == EARHART_V1_0_0
+
+        status=_radio.send_message(total_blocks+1, tx_buffer, buffer_len);
+        if (status < int(buffer_len))
+        {
+            return SEND_FAILED;
+        }
+        handle_receive(); //todo: The rx window closes too soon..
+        #if(!UPLOAD_ACKS)
+            status=mark_block_acked(ack_block);
+            if (status != NODEFLOW_OK)
+            {
+                return status;
+            }
+        #endif /* #if(!UPLOAD_ACKS) */
+        if(send_more_block)
+        {
+            ThisThread::sleep_for(10000);
+        }
+       
+    #endif /* #if BOARD      */
+
+    status=read_upload_acks(a_conf);
+    if (status != NODEFLOW_OK)
+    {
+        return status;
+    }
+    if(!is_block_acked(a_conf, ack_block))
+    {
+        debug("\r\nBlock %d not acknowledged",send_block_number);
+        upload_gap=true;
+    }
+    send_block_number++;
+
+    return NODEFLOW_OK;
+}
+
+void NodeFlow::timetodate(uint32_t remainder_time)
+{
+    double_t t_value=(remainder_time/float(HOURINSEC));
+    double_t minutes_f=fmod(t_value,1);
+    uint8_t hours= t_value- minutes_f;
+    t_value=minutes_f*MINUTEINSEC; 
+    minutes_f=(fmod(t_value,1))*MINUTEINSEC;
+    debug("Time(HH:MM:SS):   %02d:%02d:%02d\r\n", hours, int(t_value),int(minutes_f));
+}
+
+/**LorawanTP
+ */
+#if BOARD == EARHART_V1_0_0
+
+
+int NodeFlow::handle_receive()
+{   uint8_t port=0;
+    int retcode=0;
+    uint32_t rx_dec_buffer[MAX_BUFFER_READING_TIMES];
+    _radio.receive_message(rx_dec_buffer,port,retcode); 
+    
+    if (port==SCHEDULER_PORT)
+    {
+        status=overwrite_sched_config(true, DIVIDE(retcode));
+        if (status != NODEFLOW_OK)
+        {
+            ErrorHandler(__LINE__,"overwrite_sched_config",status,__PRETTY_FUNCTION__);
+        }
+
+        for (int i=0; i<DIVIDE(retcode); i++)
+        {
+            debug("\n%i.RX scheduler: %d(10)\n",i, rx_dec_buffer[i]);
+            status=append_sched_config(rx_dec_buffer[i]/2,(1<<metric_group_count)-1);
+            if (status != NODEFLOW_OK)
+            {
+                ErrorHandler(__LINE__,"append_sched_config",status,__PRETTY_FUNCTION__);
+            }
+        }
+
+        /** The received times apply to every group and replace their intervals */
+        TimeConfig p_conf[MAX_METRIC_GROUPS];
+        status=NODEFLOW_OK;
+        for(uint8_t i=0; i<metric_group_count && status == NODEFLOW_OK; i++)
+        {
+            status=read_config(MetricGroupTimesConfig_n, i, p_conf[i].data, sizeof(p_conf[i].parameters));
+        }
+        if(metric_group_count != 0 && status == NODEFLOW_OK)
+        {
+            for(uint8_t i=0; i<metric_group_count; i++)
+            {
+                p_conf[i].parameters.time_comparator=0;
+            }
+            status=overwrite_config(MetricGroupTimesConfig_n, p_conf[0].data, metric_group_count*sizeof(p_conf[0].parameters));
+        }
+        if (status != NODEFLOW_OK)
+        {
+            ErrorHandler(__LINE__,"MetricGroupTimesConfig",status,__PRETTY_FUNCTION__);
+        }
+    }
+    
+    if(port==UPLOAD_ACK_PORT)
+    {
+        /** The values are the numbers of the blocks received, none acknowledges the block just sent.
+         *  status still holds the bytes taken by the uplink that carried the downlink. */
+        status=NODEFLOW_OK;
+        if(DIVIDE(retcode) == 0)
+        {
+            status=mark_block_acked(ack_block);
+        }
+        for (int i=0; i<DIVIDE(retcode) && status == NODEFLOW_OK; i++)
+        {
+            if(rx_dec_buffer[i]/2 < UPLOAD_MAX_BLOCKS)
+            {
+                status=mark_block_acked(rx_dec_buffer[i]/2);
+            }
+        }
+        if (status != NODEFLOW_OK)
+        {
+            ErrorHandler(__LINE__,"mark_block_acked",status,__PRETTY_FUNCTION__);
+        }
+    }
+
+    if(port==CLOCK_SYNCH_ACK_PORT)
+    {
+        bool clockSynchOn=false;
+        uint16_t time;
+        status=read_clock_synch_config(time,clockSynchOn);
+        if (status != NODEFLOW_OK)
+            {
+                ErrorHandler(__LINE__,"read_clock_synch_config",status,__PRETTY_FUNCTION__);
+                return status;
+            }
+        if(retcode==1 && clockSynchOn)
+        {
+            status=overwrite_clock_synch_config(rx_dec_buffer[0]/2,false);
+            if (status != NODEFLOW_OK)
+            {
+                ErrorHandler(__LINE__,"overwrite_clock_synch_config",status,__PRETTY_FUNCTION__);
+                return status;
+            }
+        }
+        else
+        {
+            status=overwrite_clock_synch_config(rx_dec_buffer[0]/2,true);
+            if (status != NODEFLOW_OK)
+            {
+                ErrorHandler(__LINE__,"overwrite_clock_synch_config",status,__PRETTY_FUNCTION__);
+                return status;
+            }
+        }
+    }
+    if(port==SCHEDULER_PORT || port==CLOCK_SYNCH_ACK_PORT)
+    {
+        build_event_table();
+    }
+    if(port==0)
+    {
+        debug("\nNo Rx available"); 
+    }
+    else
+    {
+        debug("\r\nRx: %d(10), Port: %d", rx_dec_buffer[0], port);
+    }
+    _radio.sleep();
+    // rx_message=rx_dec_buffer[0];
+    // rx_port=port;
+    
+    return status;
+}
+#endif /* #if BOARD == EARHART_V1_0_0 */
+
+int NodeFlow::get_wakeup_flags()
+{    
+    WakeStateConfig ws_conf;
+    status=read_wake_state(ws_conf);
+    if(status != NODEFLOW_OK)
+    {
+        return status;
+    }
+
+    bitset<8> ssck_flag(ws_conf.parameters.ssck_flag);
+    if(ssck_flag.test(0) && ssck_flag.test(1) && ssck_flag.test(2))
+    {
+        return NodeFlow::FLAG_SENSE_SEND_SYNCH;
+    }
+
+    if(ssck_flag.test(1) && ssck_flag.test(2))
+    {
+        return NodeFlow::FLAG_SEND_SYNCH;
+    }
+    if(ssck_flag.test(0) && ssck_flag.test(1))
+    {
+        return NodeFlow::FLAG_SENSE_SEND;
+    }
+    if(ssck_flag.test(0) && ssck_flag.test(2))
+    {
+        return NodeFlow::FLAG_SENSE_SYNCH;
+    }
+    if(ssck_flag.test(2))
+    {
+        return NodeFlow::FLAG_CLOCK_SYNCH;
+    }
+    if(ssck_flag.test(3))
+    {
+        return NodeFlow::FLAG_WDG;
+    }
+    if(ssck_flag.test(0))
+    {
+        return NodeFlow::FLAG_SENSING;
+    }
+
+    if(ssck_flag.test(1))
+    {
+        return NodeFlow::FLAG_SENDING;
+    }
+
+    return NodeFlow::FLAG_SENDING; 
+}
+
+int NodeFlow::is_delay_pin_wakeup_flag()
+{    
+    WakeStateConfig ws_conf;
+    status=read_wake_state(ws_conf);
+    if (status != NODEFLOW_OK)
+    {
+        return status;
+    }
+     if (ws_conf.parameters.wakeup_pin)
+     {
+         return NodeFlow::FLAG_WAKEUP_PIN;
+     }
+     return NODEFLOW_OK;
+}
+
+/** Clear whatever needed i.e increments, eeprom stuff and other
+ */
+int NodeFlow::clear_after_send()
+{
+    DataTailConfig tail_conf;
+    status=read_mg_tail(tail_conf);
+    if (status!=NODEFLOW_OK)
+    {
+        return status;
+    }
+    PoolConfig pool_conf;
+    status=read_pool(pool_conf);
+    if (status!=NODEFLOW_OK)
+    {
+        return status;
+    }
+    SendCursorConfig c_conf;
+    status=read_send_cursor(c_conf);
+    if (status!=NODEFLOW_OK)
+    {
+        return status;
+    }
+    /** A cut upload took the records of its last group up to its bytes, the groups after it went out empty */
+    uint8_t cut=c_conf.parameters.open ? c_conf.parameters.cut : UPLOAD_UNCUT;
+    RecordWalk walk={};
+    if(cut != UPLOAD_UNCUT)
+    {
+        record_window_length=0;
+        parse_mg_records(get_mg_filename(cut), c_conf.parameters.skip[cut], c_conf.parameters.bytes[cut], -1, false, walk);
+        c_conf.parameters.entries[cut]=walk.records+walk.lost;
+        uint8_t order[METRIC_GROUP_FILES];
+        get_send_order(order);
+        for(uint8_t n=get_send_position(order, cut)+1; n<METRIC_GROUP_FILES; n++)
+        {
+            c_conf.parameters.bytes[order[n]]=c_conf.parameters.skip[order[n]];
+            c_conf.parameters.entries[order[n]]=0;
+        }
+    }
+    journal_begin();
+    for(uint8_t i=0; i<METRIC_GROUP_FILES; i++)
+    {
+        uint8_t filename=get_mg_filename(i);
+        int stored=0;
+        if(filename == 0 || (c_conf.parameters.open && get_mg_priority(i) == SEND_PRIORITY_URGENT)
+           || get_mg_file_bytes(filename, tail_conf, stored) != NODEFLOW_OK)
+        {
+            continue;
+        }
+        /** The records stored during the upload are kept, the urgent groups are sent on their own. The ones 
+         *  carried over by a cut upload keep the chunk of their key frame, the sent ones after it are skipped. */
+        if(i == cut)
+        {
+            release_mg_bytes(i, pool_conf, tail_conf, walk.keyframe, stored, c_conf.parameters.skip[i]);
+            c_conf.parameters.skip[i]+=c_conf.parameters.bytes[i]-walk.keyframe;
+            continue;
+        }
+        release_mg_bytes(i, pool_conf, tail_conf, c_conf.parameters.open ? c_conf.parameters.bytes[i] : -1, stored, 
+                         c_conf.parameters.skip[i]);
+    }
+    clear_mg_counter(tail_conf, c_conf.parameters.open ? c_conf.parameters.entries : NULL);
+    c_conf.parameters.open=false;
+    status=overwrite_send_cursor(c_conf);
+    if (status!=NODEFLOW_OK)
+    {
+        journal_abort();
+        return status;
+    }
+    status=overwrite_mg_tail(tail_conf);
+    if (status!=NODEFLOW_OK)
+    {
+        journal_abort();
+        return status;
+    }
+    status=overwrite_pool(pool_conf);
+    if (status!=NODEFLOW_OK)
+    {
+        journal_abort();
+        return status;
+    }
+    /** The next sample of every series is written absolute, the first of the next upload */
+    DeltaConfig d_conf = {};
+    status=overwrite_config(DeltaConfig_n, d_conf.data, sizeof(d_conf.parameters));
+    if (status!=NODEFLOW_OK)
+    {
+        journal_abort();
+        return status;
+    }
+
+   clear_increment();
+ return journal_commit();
+}
+
+/** Config files kept in RAM for a wake: filename, record length, max records, write through, journaled.
+ *  Single record files are assumed to hold their record. The metric group tail and pool table 
+ *  are written through, they must stay in step with the chunks appended. The send cursor and the 
+ *  acknowledgements of its blocks are journaled when both are flushed, see cache_flush().
+ */
+static const struct
+{
+    uint8_t filename;
+    uint8_t record_length;
+    uint8_t capacity;
+    bool write_through;
+    bool journaled;
+} cache_layout[CONFIG_CACHE_FILES] =
+{
+    {WakeStateConfig_n,             sizeof(WakeStateConfig::parameters),            1,                          false,  false},
+    {ClockSynchFlag_n,              sizeof(FlagsConfig::parameters),                1,                          false,  false},
+    {SchedulerConfig_n,             sizeof(SchedulerConfig::parameters),            MAX_BUFFER_READING_TIMES+2, false,  false},
+    {SendSchedulerConfig_n,         sizeof(TimeConfig::parameters),                 MAX_BUFFER_SENDING_TIMES+2, false,  false},
+    {MetricGroupTimesConfig_n,      sizeof(TimeConfig::parameters),                 MAX_METRIC_GROUPS,          false,  false},
+    {TempMetricGroupTimesConfig_n,  sizeof(TimeConfig::parameters),                 MAX_METRIC_GROUPS,          false,  false},
+    {DataTailConfig_n,              sizeof(DataTail),                               METRIC_GROUP_FILES,         true,   false},
+    {PoolConfig_n,                  sizeof(PoolConfig::parameters),                 1,                          true,   false},
+    {DeltaConfig_n,                 sizeof(DeltaConfig::parameters),                1,                          false,  false},
+    {EventConfig_n,                 sizeof(EventConfig::parameters),                1,                          false,  false},
+    {SendCursorConfig_n,            sizeof(SendCursorConfig::parameters),           1,                          false,  true},
+    {UploadAckConfig_n,             sizeof(UploadAckConfig::parameters),            1,                          false,  true}
+};
+
+/** Arms the cache for this wake. Each file of cache_layout is read from the eeprom on its first 
+ *  access, files that don't exist or don't fit are left to the DataManager.
+ */
+void NodeFlow::cache_load()
+{
+    int offset=0;
+    for(int i=0; i<CONFIG_CACHE_FILES; i++)
+    {
+        ConfigCache& cache=config_cache[i];
+        cache.filename=cache_layout[i].filename;
+        cache.record_length=cache_layout[i].record_length;
+        cache.capacity=cache_layout[i].capacity;
+        cache.write_through=cache_layout[i].write_through;
+        cache.journaled=cache_layout[i].journaled;
+        cache.data=&config_cache_pool[offset];
+        cache.entries=0;
+        cache.loaded=false;
+        cache.valid=false;
+        cache.dirty=false;
+        cache.touched=false;
+        offset+=cache.record_length*cache.capacity;
+    }
+    config_cache_loaded=true;
+}
+
+int NodeFlow::load_config(ConfigCache* cache)
+{
+    cache->loaded=true;
+    int entries=1;
+    if(cache->capacity > 1)
+    {
+        status=DataManager::get_total_written_file_entries(cache->filename, entries);
+        eeprom_calls++;
+        if(status != NODEFLOW_OK || entries > cache->capacity)
+        {
+            return status;
+        }
+    }
+    for(int y=0; y<entries; y++)
+    {
+        status=DataManager::read_file_entry(cache->filename, y, &cache->data[y*cache->record_length], cache->record_length);
+        eeprom_calls++;
+        if(status != NODEFLOW_OK)
+        {
+            return status;
+        }
+    }
+    cache->entries=entries;
+    cache->valid=true;
+    return NODEFLOW_OK;
+}
+
+int NodeFlow::cache_flush()
+{
+    int ret=NODEFLOW_OK;
+    if(!config_cache_loaded)
+    {
+        return ret;
+    }
+    
+    /** The files that must land together are journaled when more than one of them is dirty, the others 
+     *  are rebuilt or recounted by a reset boot and are written on their own */
+    int journaled=0;
+    for(int i=0; i<CONFIG_CACHE_FILES; i++)
+    {
+        if(config_cache[i].valid && config_cache[i].dirty && config_cache[i].journaled)
+        {
+            journaled++;
+        }
+    }
+    for(int i=0; i<CONFIG_CACHE_FILES; i++)
+    {
+        if(journaled > 1 && config_cache[i].journaled)
+        {
+            continue;
+        }
+        status=flush_config(&config_cache[i]);
+        if(status != NODEFLOW_OK)
+        {
+            ErrorHandler(__LINE__,"cache_flush",status,__PRETTY_FUNCTION__);
+            ret=status;
+        }
+    }
+    if(journaled < 2)
+    {
+        return ret;
+    }
+    /** A failed commit leaves the journaled files as they were, the upload resumes at an earlier block */
+    journal_begin();
+    for(int i=0; i<CONFIG_CACHE_FILES; i++)
+    {
+        config_cache[i].touched=(config_cache[i].valid && config_cache[i].dirty);
+    }
+    status=journal_commit();
+    return (status == NODEFLOW_OK) ? ret : status;
+}
+
+int NodeFlow::flush_config(ConfigCache* cache)
+{
+    if(!cache->valid || !cache->dirty)
+    {
+        return NODEFLOW_OK;
+    }
+    if(cache->entries == 0)
+    {
+        status=DataManager::delete_file_entries(cache->filename);
+        eeprom_calls++;
+    }
+    for(int y=0; y<cache->entries; y++)
+    {
+        if(y == 0)
+        {
+            status=DataManager::overwrite_file_entries(cache->filename, cache->data, cache->record_length);
+        }
+        else
+        {
+            status=DataManager::append_file_entry(cache->filename, &cache->data[y*cache->record_length], cache->record_length);
+        }
+        eeprom_calls++;
+        if(status != NODEFLOW_OK)
+        {
+            return status;
+        }
+    }
+    cache->dirty=false;
+    return NODEFLOW_OK;
+}
+
+ConfigCache* NodeFlow::get_config_cache(uint8_t filename)
+{
+    if(!config_cache_loaded)
+    {
+        return NULL;
+    }
+    for(int i=0; i<CONFIG_CACHE_FILES; i++)
+    {
+        if(config_cache[i].filename == filename)
+        {
+            if(!config_cache[i].loaded)
             {
-                available=buffer_len;
+                load_config(&config_cache[i]);
             }
-            read_write_entry(group, done ,done+available, filename);
-            done += available;
-            tformatter.get_entries(entries);
-            if (entries >= TP_TX_BUFFER )
+            if(config_cache[i].valid)
             {
-                status=_send_blocks();
-                if (status < NODEFLOW_OK)
-                {
-                    debug("\r\nLine %d",__LINE__);
-                    return status;
-                }
+                return &config_cache[i];
             }
-            available= buffer_len - done;
+            return NULL;
         }
     }
-    return NodeFlow::NODEFLOW_OK;
+    return NULL;
 }
-int NodeFlow::_send_blocks()
+
+int NodeFlow::read_config(uint8_t filename, int i, char* data, int length)
 {
-    uint8_t send_more_block=0;
-    if(total_blocks> send_block_number)
+    ConfigCache* cache=get_config_cache(filename);
+    if(cache != NULL && i < cache->entries && length == cache->record_length)
     {
-        send_more_block=1;
+        memcpy(data, &cache->data[i*length], length);
+        return NODEFLOW_OK;
     }
-    size_t buffer_len=0;
-    uint16_t c_entries;
-    tformatter.get_entries(c_entries);
-    buffer= new uint8_t[c_entries];
-    buffer=tformatter.return_serialised(buffer_len);
-
-    debug("\r\nSending %d bytes, msg: %d, more_block: %d",buffer_len, send_block_number,send_more_block);
-    int response_code=-1;
-    
-    #if BOARD == WRIGHT_V1_0_0
-        recv_data= new char[50];
-        status=_radio.coap_post(buffer, buffer_len, recv_data, SaraN2::TEXT_PLAIN, send_block_number,
-                                send_more_block, response_code);
-    
-        if((response_code == 0 || response_code == 2) && (send_more_block == false) ) 
-        {
-            debug("\r\nHorrayy, you just sended a message!");
-            clear_after_send();
-        } 
-        if(status!=NODEFLOW_OK)
-        {
-            debug("\r\nUnsuccess..");
-            return SEND_FAILED;
-        }
-        
-    #endif /* BOARD == WRIGHT_V1_0_0 */
-
-    #if BOARD == EARHART_V1_0_0
+    eeprom_calls++;
+    return DataManager::read_file_entry(filename, i, data, length);
+}
 
-        status=_radio.send_message(total_blocks+1, buffer, buffer_len);
-        if (status < NODEFLOW_OK)
-        {
-            return SEND_FAILED;
-        }
-        handle_receive(); //todo: The rx window closes too soon..
-        if(send_more_block)
+int NodeFlow::overwrite_config(uint8_t filename, char* data, int length)
+{
+    ConfigCache* cache=get_config_cache(filename);
+    if(cache == NULL || length % cache->record_length != 0 || length > cache->capacity*cache->record_length)
+    {
+        if(cache != NULL)
         {
-            ThisThread::sleep_for(10000);
+            cache->valid=false;
         }
-        if (status >= NODEFLOW_OK && send_more_block == false) 
+        eeprom_calls++;
+        return DataManager::overwrite_file_entries(filename, data, length);
+    }
+    if(cache->write_through && !journal_open)
+    {
+        eeprom_calls++;
+        status=DataManager::overwrite_file_entries(filename, data, length);
+        if(status != NODEFLOW_OK)
         {
-            clear_after_send();
+            return status;
         }
-       
-    #endif /* #if BOARD      */
-
-    delete [] buffer;
-    delete [] recv_data;
-    send_block_number++;
-
+    }
+    else if(cache->entries != length/cache->record_length || memcmp(cache->data, data, length) != 0)
+    {
+        cache->dirty=true;
+        cache->touched|=journal_open;
+    }
+    memcpy(cache->data, data, length);
+    cache->entries=length/cache->record_length;
     return NODEFLOW_OK;
 }
 
-void NodeFlow::timetodate(uint32_t remainder_time)
-{
-    double_t t_value=(remainder_time/float(HOURINSEC));
-    double_t minutes_f=fmod(t_value,1);
-    uint8_t hours= t_value- minutes_f;
-    t_value=minutes_f*MINUTEINSEC; 
-    minutes_f=(fmod(t_value,1))*MINUTEINSEC;
-    debug("Time(HH:MM:SS):   %02d:%02d:%02d\r\n", hours, int(t_value),int(minutes_f));
-}
-
-/**LorawanTP
+/** The DataManager only writes a file whole. A cached record is changed in RAM and the file goes out 
+ *  with the flush, an uncached file is read back around the record.
  */
-#if BOARD == EARHART_V1_0_0
-
-
-int NodeFlow::handle_receive()
-{   uint8_t port=0;
-    int retcode=0;
-    uint32_t rx_dec_buffer[MAX_BUFFER_READING_TIMES];
-    _radio.receive_message(rx_dec_buffer,port,retcode); 
-    
-    if (port==SCHEDULER_PORT)
+int NodeFlow::modify_config(uint8_t filename, int i, char* data, int length)
+{
+    ConfigCache* cache=get_config_cache(filename);
+    if(cache != NULL && i < cache->entries && length == cache->record_length && !cache->write_through)
     {
-        status=overwrite_sched_config(true, DIVIDE(retcode));
-        if (status != NODEFLOW_OK)
-        {
-            ErrorHandler(__LINE__,"overwrite_sched_config",status,__PRETTY_FUNCTION__);
-        }
-
-        for (int i=0; i<DIVIDE(retcode); i++)
+        if(memcmp(&cache->data[i*length], data, length) != 0)
         {
-            debug("\n%i.RX scheduler: %d(10)\n",i, rx_dec_buffer[i]);
-            status=append_sched_config(rx_dec_buffer[i]/2,1); //TODO: CHANGE GROUP ID- depends on data
-            if (status != NODEFLOW_OK)
-            {
-                ErrorHandler(__LINE__,"append_sched_config",status,__PRETTY_FUNCTION__);
-            }
+            memcpy(&cache->data[i*length], data, length);
+            cache->dirty=true;
+            cache->touched|=journal_open;
         }
+        return NODEFLOW_OK;
     }
-    
-    if(port==CLOCK_SYNCH_ACK_PORT)
+    int entries=0;
+    status=DataManager::get_total_written_file_entries(filename, entries);
+    eeprom_calls++;
+    if(status != NODEFLOW_OK || i >= entries)
     {
-        bool clockSynchOn=false;
-        uint16_t time;
-        status=read_clock_synch_config(time,clockSynchOn);
-        if (status != NODEFLOW_OK)
-            {
-                ErrorHandler(__LINE__,"read_clock_synch_config",status,__PRETTY_FUNCTION__);
-                return status;
-            }
-        if(retcode==1 && clockSynchOn)
+        return (status != NODEFLOW_OK) ? status : DATA_MANAGER_FAIL;
+    }
+    char file[entries*length];
+    for(int y=0; y<entries; y++)
+    {
+        status=read_config(filename, y, &file[y*length], length);
+        if(status != NODEFLOW_OK)
         {
-            status=overwrite_clock_synch_config(rx_dec_buffer[0]/2,false);
-            if (status != NODEFLOW_OK)
-            {
-                ErrorHandler(__LINE__,"overwrite_clock_synch_config",status,__PRETTY_FUNCTION__);
-                return status;
-            }
+            return status;
         }
-        else
+    }
+    memcpy(&file[i*length], data, length);
+    return overwrite_config(filename, file, entries*length);
+}
+
+int NodeFlow::append_config(uint8_t filename, char* data, int length)
+{
+    ConfigCache* cache=get_config_cache(filename);
+    if(cache == NULL || length != cache->record_length || cache->entries >= cache->capacity)
+    {
+        if(cache != NULL)
         {
-            status=overwrite_clock_synch_config(rx_dec_buffer[0]/2,true);
-            if (status != NODEFLOW_OK)
+            /** The eeprom must hold the cached entries before appending behind them */
+            status=flush_config(cache);
+            if(status != NODEFLOW_OK)
             {
-                ErrorHandler(__LINE__,"overwrite_clock_synch_config",status,__PRETTY_FUNCTION__);
                 return status;
             }
+            cache->valid=false;
         }
+        eeprom_calls++;
+        return DataManager::append_file_entry(filename, data, length);
     }
-    if(port==0)
+    if(cache->write_through && !journal_open)
     {
-        debug("\nNo Rx available"); 
+        eeprom_calls++;
+        status=DataManager::append_file_entry(filename, data, length);
+        if(status != NODEFLOW_OK)
+        {
+            return status;
+        }
     }
     else
     {
-        debug("\r\nRx: %d(10), Port: %d", rx_dec_buffer[0], port);
+        cache->dirty=true;
+        cache->touched|=journal_open;
     }
-    _radio.sleep();
-    // rx_message=rx_dec_buffer[0];
-    // rx_port=port;
-    
-    return status;
+    memcpy(&cache->data[cache->entries*length], data, length);
+    cache->entries++;
+    return NODEFLOW_OK;
 }
-#endif /* #if BOARD == EARHART_V1_0_0 */
 
-int NodeFlow::get_wakeup_flags()
-{    
-    FlagsConfig f_conf;
-    status=DataManager::read_file_entry(FlagSSCKConfig_n, 0, f_conf.data,sizeof(f_conf.parameters));
-    if(status != NODEFLOW_OK)
+void NodeFlow::journal_begin()
+{
+    journal_open=true;
+    journal_crc=0xFFFF;
+    journal_records=0;
+    journal_counters=0;
+    for(int i=0; i<CONFIG_CACHE_FILES && config_cache_loaded; i++)
     {
-        ErrorHandler(__LINE__,"FlagSSCKConfig",status,__PRETTY_FUNCTION__);
-        return status;
+        config_cache[i].touched=false;
     }
+}
 
-    bitset<8> ssck_flag(f_conf.parameters.value);
-    if(ssck_flag.test(0) && ssck_flag.test(1) && ssck_flag.test(2))
+void NodeFlow::journal_abort()
+{
+    journal_open=false;
+    journal_counters=0;
+    for(int i=0; i<CONFIG_CACHE_FILES && config_cache_loaded; i++)
     {
-        return NodeFlow::FLAG_SENSE_SEND_SYNCH;
+        ConfigCache& cache=config_cache[i];
+        if(cache.touched)
+        {
+            /** Read again from the eeprom on the next access */
+            cache.loaded=false;
+            cache.valid=false;
+            cache.dirty=false;
+            cache.touched=false;
+        }
     }
+    DataManager::delete_file_entries(JournalConfig_n);
+    eeprom_calls++;
+}
 
-    if(ssck_flag.test(1) && ssck_flag.test(2))
+int NodeFlow::journal_commit()
+{
+    status=NODEFLOW_OK;
+    for(int i=0; i<CONFIG_CACHE_FILES && config_cache_loaded; i++)
     {
-        return NodeFlow::FLAG_SEND_SYNCH;
+        ConfigCache& cache=config_cache[i];
+        if(cache.valid && cache.dirty)
+        {
+            status=journal_write(cache.filename, cache.record_length, cache.data, cache.entries*cache.record_length);
+            if(status != NODEFLOW_OK)
+            {
+                break;
+            }
+        }
     }
-    if(ssck_flag.test(0) && ssck_flag.test(1))
+    if(status != NODEFLOW_OK)
     {
-        return NodeFlow::FLAG_SENSE_SEND;
+        journal_abort();
+        ErrorHandler(__LINE__,"JournalConfig",status,__PRETTY_FUNCTION__);
+        return status;
     }
-    if(ssck_flag.test(0) && ssck_flag.test(2))
+    journal_open=false;
+    if(journal_records == 0)
     {
-        return NodeFlow::FLAG_SENSE_SYNCH;
+        return NODEFLOW_OK;
     }
-    if(ssck_flag.test(2))
+
+    JournalConfig j_conf={};
+    j_conf.parameters.flags=JOURNAL_COMMIT;
+    j_conf.parameters.length=journal_records;
+    memcpy(j_conf.parameters.byte, &journal_crc, sizeof(journal_crc));
+    status=DataManager::append_file_entry(JournalConfig_n, j_conf.data, sizeof(j_conf.parameters));
+    eeprom_calls++;
+    if(status != NODEFLOW_OK)
     {
-        return NodeFlow::FLAG_CLOCK_SYNCH;
+        journal_abort();
+        ErrorHandler(__LINE__,"JournalConfig",status,__PRETTY_FUNCTION__);
+        return status;
     }
-    if(ssck_flag.test(3))
+    /** The images are written from RAM, the journal is only read back by a boot after a reset */
+    for(int i=0; i<CONFIG_CACHE_FILES && config_cache_loaded; i++)
     {
-        return NodeFlow::FLAG_WDG;
+        status=flush_config(&config_cache[i]);
+        if(status != NODEFLOW_OK)
+        {
+            ErrorHandler(__LINE__,"JournalConfig",status,__PRETTY_FUNCTION__);
+            return status;
+        }
     }
-    if(ssck_flag.test(0))
+    for(uint8_t i=0; i<3; i++)
     {
-        return NodeFlow::FLAG_SENSING;
+        if(journal_counters & (1 << i))
+        {
+            CounterConfig c_conf;
+            c_conf.parameters.value=journal_counter[i];
+            status=DataManager::overwrite_file_entries(IncrementAConfig_n+i, c_conf.data, sizeof(c_conf.parameters));
+            eeprom_calls++;
+            if(status != NODEFLOW_OK)
+            {
+                ErrorHandler(__LINE__,"JournalConfig",status,__PRETTY_FUNCTION__);
+                return status;
+            }
+        }
     }
-
-    if(ssck_flag.test(1))
+    status=DataManager::delete_file_entries(JournalConfig_n);
+    eeprom_calls++;
+    if(status != NODEFLOW_OK)
     {
-        return NodeFlow::FLAG_SENDING;
+        ErrorHandler(__LINE__,"JournalConfig",status,__PRETTY_FUNCTION__);
     }
+    return status;
+}
 
-    return NodeFlow::FLAG_SENDING; 
+int NodeFlow::journal_write(uint8_t filename, uint8_t record_length, const char* data, int length)
+{
+    int done=0;
+    do
+    {
+        JournalConfig j_conf={};
+        j_conf.parameters.filename=filename;
+        j_conf.parameters.record_length=record_length;
+        j_conf.parameters.flags=(done == 0) ? JOURNAL_IMAGE : 0;
+        j_conf.parameters.length=std::min(length-done, DATA_CHUNK_SIZE);
+        memcpy(j_conf.parameters.byte, &data[done], j_conf.parameters.length);
+
+        status=DataManager::append_file_entry(JournalConfig_n, j_conf.data, sizeof(j_conf.parameters));
+        eeprom_calls++;
+        if(status != NODEFLOW_OK)
+        {
+            return status;
+        }
+        journal_crc=crc16(j_conf.data, sizeof(j_conf.parameters), journal_crc);
+        journal_records++;
+        done+=j_conf.parameters.length;
+    } while(done < length);
+
+    return NODEFLOW_OK;
 }
 
-int NodeFlow::is_delay_pin_wakeup_flag()
-{    
-    FlagsConfig f_conf;
-    status=DataManager::read_file_entry(FlagSSCKConfig_n, 0, f_conf.data,sizeof(f_conf.parameters));
-    if (status != NODEFLOW_OK)
+int NodeFlow::journal_replay()
+{
+    int entries=0;
+    status=DataManager::get_total_written_file_entries(JournalConfig_n, entries);
+    if(status != NODEFLOW_OK || entries == 0)
     {
-        ErrorHandler(__LINE__,"FlagSSCKConfig",status,__PRETTY_FUNCTION__);
         return status;
     }
-     if (f_conf.parameters.flag)
-     {
-         return NodeFlow::FLAG_WAKEUP_PIN;
-     }
-     return NODEFLOW_OK;
-}
 
-/** Clear whatever needed i.e increments, eeprom stuff and other
- */
-int NodeFlow::clear_after_send()
-{
-    #if (INTERRUPT_ON)
-        status= DataManager::delete_file_entries(InterruptConfig_n);
-        if (status!=NODEFLOW_OK)
-        {
-            ErrorHandler(__LINE__,"InterruptConfig_n",status,__PRETTY_FUNCTION__); 
-        }
-    #endif
-    status= DataManager::delete_file_entries(MetricGroupAConfig_n);
-    if (status!=NODEFLOW_OK)
+    JournalConfig j_conf;
+    status=DataManager::read_file_entry(JournalConfig_n, entries-1, j_conf.data, sizeof(j_conf.parameters));
+    eeprom_calls++;
+    bool committed=(status == NODEFLOW_OK && (j_conf.parameters.flags & JOURNAL_COMMIT) 
+                    && j_conf.parameters.length == entries-1);
+    uint16_t crc=0xFFFF;
+    uint16_t commit_crc;
+    memcpy(&commit_crc, j_conf.parameters.byte, sizeof(commit_crc));
+    for(int i=0; i<entries-1 && committed; i++)
     {
-        ErrorHandler(__LINE__,"MetricGroupAConfig_n",status,__PRETTY_FUNCTION__); 
+        status=DataManager::read_file_entry(JournalConfig_n, i, j_conf.data, sizeof(j_conf.parameters));
+        eeprom_calls++;
+        committed=(status == NODEFLOW_OK);
+        crc=crc16(j_conf.data, sizeof(j_conf.parameters), crc);
     }
-    #if (SCHEDULER_B || METRIC_GROUPS_ON==4 || METRIC_GROUPS_ON==3|| METRIC_GROUPS_ON==2)
-        status= DataManager::delete_file_entries(MetricGroupBConfig_n);
-        if (status!=NODEFLOW_OK)
-        {
-            ErrorHandler(__LINE__,"MetricGroupBConfig_n",status,__PRETTY_FUNCTION__); 
-        }
-    #endif /* #if (SCHEDULER_B || METRIC_GROUPS_ON==2) */
-    #if (SCHEDULER_C || METRIC_GROUPS_ON==4 || METRIC_GROUPS_ON==3)
-        status= DataManager::delete_file_entries(MetricGroupCConfig_n);
-        if (status!=NODEFLOW_OK)
+    if(committed && crc == commit_crc)
+    {
+        /** Records of the file are rebuilt here, they can span two journal records */
+        char record[UINT8_MAX];
+        int filled=0;
+        int y=0;
+        for(int i=0; i<entries-1; i++)
         {
-            ErrorHandler(__LINE__,"MetricGroupCConfig_n",status,__PRETTY_FUNCTION__); 
+            status=DataManager::read_file_entry(JournalConfig_n, i, j_conf.data, sizeof(j_conf.parameters));
+            eeprom_calls++;
+            if(status != NODEFLOW_OK)
+            {
+                ErrorHandler(__LINE__,"JournalConfig",status,__PRETTY_FUNCTION__);
+                return status;
+            }
+            uint8_t filename=j_conf.parameters.filename;
+            uint8_t record_length=j_conf.parameters.record_length;
+            if(j_conf.parameters.flags & JOURNAL_IMAGE)
+            {
+                filled=0;
+                y=0;
+                if(j_conf.parameters.length == 0)
+                {
+                    DataManager::delete_file_entries(filename);
+                    eeprom_calls++;
+                }
+            }
+            for(int b=0; b<j_conf.parameters.length; b++)
+            {
+                record[filled++]=j_conf.parameters.byte[b];
+                if(filled == record_length)
+                {
+                    if(y == 0)
+                    {
+                        status=DataManager::overwrite_file_entries(filename, record, record_length);
+                    }
+                    else
+                    {
+                        status=DataManager::append_file_entry(filename, record, record_length);
+                    }
+                    eeprom_calls++;
+                    if(status != NODEFLOW_OK)
+                    {
+                        ErrorHandler(__LINE__,"JournalConfig",status,__PRETTY_FUNCTION__);
+                        return status;
+                    }
+                    filled=0;
+                    y++;
+                }
+            }
         }
-    #endif /* #if (SCHEDULER_C || METRIC_GROUPS_ON==3) */
-    #if (SCHEDULER_D || METRIC_GROUPS_ON==4)
-    status= DataManager::delete_file_entries(MetricGroupDConfig_n);
-    if (status!=NODEFLOW_OK)
+    }
+    else
+    {
+        debug("\r\nJournal not committed, %d records dropped",entries);
+    }
+    
+    status=DataManager::delete_file_entries(JournalConfig_n);
+    eeprom_calls++;
+    if(status != NODEFLOW_OK)
     {
-        ErrorHandler(__LINE__,"MetricGroupDConfig_n",status,__PRETTY_FUNCTION__); 
+        ErrorHandler(__LINE__,"JournalConfig",status,__PRETTY_FUNCTION__);
     }
-    #endif /* #if (SCHEDULER_D || METRIC_GROUPS_ON==4) */
+    return status;
+}
 
-   clear_increment();
-   clear_mg_counter();   
- return NODEFLOW_OK;
+uint16_t NodeFlow::crc16(const char* data, int length, uint16_t crc)
+{
+    for(int i=0; i<length; i++)
+    {
+        crc^=uint16_t(uint8_t(data[i]))<<8;
+        for(int b=0; b<8; b++)
+        {
+            crc=(crc & 0x8000) ? (crc<<1)^0x1021 : crc<<1;
+        }
+    }
+    return crc;
 }
 
 /** Manage device sleep times before calling sleep_manager.standby().
@@ -2516,6 +4479,12 @@ void NodeFlow::enter_standby(int seconds, bool wkup_one)
         int retcode=_radio.sleep();
     #endif /* BOARD == EARHART_V1_0_0 */
 
+    phase_begin();
+    cache_flush();
+    phase_end(PHASE_FLUSH);
+    overwrite_latency_model();
+    debug("\r\nDataManager calls: %d", eeprom_calls);
+
     //Without this delay it breaks..?!
     ThisThread::sleep_for(1);
     sleep_manager.standby(seconds, wkup_one);
@@ -2538,6 +4507,13 @@ void NodeFlow::ErrorHandler(int line, const char* str1, int status,const char* s
     debug("\r\nError in line No = %d, %s,Status = %d,Function name = %s, Errors %d\r\n",line, str1, status, str2, errCnt);
     if(error)
     {
+        /** The reset boots again, the files cached in RAM are written first. A group of journaled writes
+         *  left open is dropped whole, a flush failing on the same line doesn't flush again. */
+        if(config_cache_loaded && !journal_open && !reset_flush)
+        {
+            reset_flush=true;
+            cache_flush();
+        }
        #if BOARD == EARHART_V1_0_0
             uint8_t error[3]={5,uint8_t(line),uint8_t(status)};
             _radio.send_message(219, error, 3);
@@ -2557,50 +4533,47 @@ int NodeFlow::error_increment(int &errCnt, uint16_t line, bool &error)
 {
     errCnt=0;
     error=false;
-    ErrorConfig e_conf;
-    status = DataManager::read_file_entry(ErrorConfig_n, 0, e_conf.data, sizeof(e_conf.parameters));
+    int entries=0;
+    status = DataManager::get_total_written_file_entries(ErrorConfig_n, entries);
     if (status!=NODEFLOW_OK)
     {
         errCnt=0;
         error=true;
         return 0;
     }
-    error=false;
-    uint16_t arr[20];
-    arr[e_conf.parameters.errCnt]=line;
-    for (int i = 0; i < e_conf.parameters.errCnt; i++) 
+
+    /** Only the last two entries are read, the error is critical if they are on the same line */
+    int same_line=0;
+    for (int i = 1; i <= 2 && i <= entries; i++) 
     {   
-        arr[i]=e_conf.parameters.line_arr[i];
-        
-        if (e_conf.parameters.line_arr[i] ==  e_conf.parameters.line_arr[i+1] 
-            && e_conf.parameters.line_arr[i+1] == e_conf.parameters.line_arr[i+2]
-            && e_conf.parameters.errCnt>=STATUS_ERROR_TOLERANCE) 
-        {   
-            error=true;
-        } 
+        ErrorConfig e_conf;
+        status = DataManager::read_file_entry(ErrorConfig_n, entries-i, e_conf.data, sizeof(e_conf.parameters));
+        if (status!=NODEFLOW_OK || e_conf.parameters.line != line)
+        {
+            break;
+        }
+        same_line++;
     }
+    error=(same_line == 2 && entries+1 >= STATUS_ERROR_TOLERANCE);
 
-    for (int i=0; i<e_conf.parameters.errCnt+1; i++)
+    ErrorConfig e_conf;
+    e_conf.parameters.line=line;
+    if (entries >= ERROR_LOG_SLOTS)
     {
-            e_conf.parameters.line_arr[i]=arr[i];
+        status= DataManager::overwrite_file_entries(ErrorConfig_n, e_conf.data, sizeof(e_conf.parameters));
+        entries=0;
     }
-    e_conf.parameters.errCnt=1+e_conf.parameters.errCnt;
-
-    if(e_conf.parameters.errCnt>19)
+    else
     {
-        e_conf.parameters.errCnt=0;
+        status= DataManager::append_file_entry(ErrorConfig_n, e_conf.data, sizeof(e_conf.parameters));
     }
-    status= DataManager::overwrite_file_entries(ErrorConfig_n, e_conf.data, sizeof(e_conf.parameters));
     if (status!=NODEFLOW_OK)
     {
         errCnt=0;
         error=false;
         return 0;
     }
-    else
-    {
-        errCnt=e_conf.parameters.errCnt;
-    }
+    errCnt=entries+1;
     
     return 0;
 }
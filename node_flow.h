@@ -1,7 +1,7 @@
 /**
  ******************************************************************************
  * @file    NodeFLow.h
- * @version 0.4.0
+ * @version 0.5.0
  * @author  Rafaella Nofytou,  Adam Mitchell
  * @brief   Header file of the Wright || Earheart node from Think Pilot. 
  * Handles sleeping times/ eeprom driver/ lorawan/ nb-iot communication
@@ -49,34 +49,137 @@
 #define MAX_SEND_RETRIES 3
 #define MAX_OVERWRITE_RETRIES 3
 
-#if (!SCHEDULER_B)
-    #define SCHEDULER_B_SIZE 0
+#if(SEND_SCHEDULER)
+     extern float send_scheduler[];
+#endif
+
+#define MAX_BUFFER_SENDING_TIMES 10
+#if(SEND_SCHEDULER)
+    #define SEND_SCHEDULER_TIMES (MAX_BUFFER_SENDING_TIMES+2)
+#else
+    #define SEND_SCHEDULER_TIMES 2
+#endif
+
+/** Metric groups the application can register with NodeFlow::add_metric_group(). Each group is a bit 
+ *  of the event masks, so at most 12.
+ */
+#ifndef MAX_METRIC_GROUPS
+    #define MAX_METRIC_GROUPS 4
+#endif
+
+/** Bytes of the STM24256 eeprom
+ */
+#define EEPROM_BYTES 32768
+
+/** Eeprom bytes shared by the metric group and interrupt files. Payload bytes are stored
+ *  packed, one eeprom byte per serialised byte.
+ */
+#define METRIC_STORAGE_BYTES 28000
+
+/** Payload bytes per metric group record. Half an STM24256 page, so a record never needs
+ *  more than two page writes.
+ */
+#define DATA_CHUNK_SIZE 32
+
+/** Every record of a metric group is stored as its length, the CRC-16 of the length and the payload,
+ *  then the payload. The payload is the time stamp of the record followed by the tformatter buffer of 
+ *  add_payload_data(), at most MAX_RECORD_SIZE bytes.
+ */
+#define RECORD_HEADER_SIZE 3
+#define MAX_RECORD_SIZE (100+RECORD_STAMP_SIZE)
+
+/** The time stamp of a record is a CBOR integer, the seconds since the base time of its group. The base
+ *  is the UNIX time of the first record stored after a send, it's uploaded first in the array of the group.
+ */
+#define RECORD_STAMP_SIZE 5
+#define RECORD_BASE_SIZE 5
+
+/** Records are compressed against the last record stored uncompressed in the group, its key frame.
+ *  A compressed record has RECORD_COMPRESSED set in its length, see NodeFlow::compress_record().
+ *  Every extent starts with a key frame, so evicting one doesn't cut the records of the next from theirs.
+ *  Compression only saves storage, the reader decompresses and the upload is the same bytes.
+ */
+#ifndef METRIC_COMPRESSION
+    #define METRIC_COMPRESSION 1
 #endif
-#if (!SCHEDULER_C)
-    #define SCHEDULER_C_SIZE 0
+#define RECORD_COMPRESSED 0x80
+#define COMPRESSION_MIN_MATCH 3
+#define COMPRESSION_MAX_MATCH (0x7F+COMPRESSION_MIN_MATCH)
+
+/** Numeric series added with add_delta_record() are written as the smallest CBOR integer of the difference 
+ *  from the previous sample of the same key. The first sample after a send or a reset, after a key slot is 
+ *  reused and every DELTA_INTERVAL samples is written absolute and wrapped in tag DELTA_CBOR_TAG, the 
+ *  untagged samples of the key after it are differences. A reader that lost a block or an evicted extent
+ *  drops the series until its next tag. The tag is in the first come first served range of the CBOR 
+ *  registry, encoded in 2 bytes, the reader must use the same number.
+ */
+#ifndef DELTA_KEYS
+    #define DELTA_KEYS 8
 #endif
-#if (!SCHEDULER_D)
-    #define SCHEDULER_D_SIZE 0
+#ifndef DELTA_INTERVAL
+    #define DELTA_INTERVAL 16
 #endif
-#if (SCHEDULER)
-    #define SCHEDULER_SIZE (SCHEDULER_A_SIZE + SCHEDULER_B_SIZE +  SCHEDULER_C_SIZE + SCHEDULER_D_SIZE)
-    extern float scheduler[]; 
-    extern float schedulerA[];
-    extern float schedulerB[];
-    extern float schedulerC[];
-    extern float schedulerD[];
+#ifndef DELTA_CBOR_TAG
+    #define DELTA_CBOR_TAG 0xDE17
 #endif
+static_assert(DELTA_CBOR_TAG >= 0x8000 && DELTA_CBOR_TAG <= 0xFFFF, "DELTA_CBOR_TAG is a 2 byte first come first served tag");
 
-#if(!SCHEDULER)
-    #define SCHEDULER_SIZE METRIC_GROUPS_ON
-    extern float scheduler[]; 
+/** Interrupt file plus the metric groups, indexed by the metric group flag. 0 is the interrupt and 1 the 
+ *  first group registered. The interrupt data are uploaded with INTERRUPT_GROUP_TAG, 5 as in the releases
+ *  with the four MetricGroupA-D groups. A build of more groups sets it above MAX_METRIC_GROUPS.
+ */
+#define METRIC_GROUP_FILES (MAX_METRIC_GROUPS+1)
+#ifndef INTERRUPT_GROUP_TAG
+    #define INTERRUPT_GROUP_TAG 5
 #endif
+static_assert(INTERRUPT_GROUP_TAG > MAX_METRIC_GROUPS, "INTERRUPT_GROUP_TAG is outside the group ids");
+static_assert(INTERRUPT_GROUP_TAG < 24, "A group tag is a one byte CBOR integer, see NodeFlow::write_group_head()");
 
-#if(SEND_SCHEDULER)
-     extern float send_scheduler[];
+/** Send priorities of the metric groups, see NodeFlow::set_metric_group_priority(). The upload drains the
+ *  groups in priority order, the urgent ones are left out of it and go out in an uplink of their own as
+ *  soon as their records are stored. The interrupt file is urgent unless INTERRUPT_PRIORITY says otherwise.
+ */
+#define SEND_PRIORITY_URGENT 0
+#define SEND_PRIORITY_HIGH 1
+#define SEND_PRIORITY_NORMAL 2
+#define SEND_PRIORITY_BULK 3
+#ifndef INTERRUPT_PRIORITY
+    #define INTERRUPT_PRIORITY SEND_PRIORITY_URGENT
 #endif
 
-#define MAX_BUFFER_SENDING_TIMES 10
+/** Metric group pool. METRIC_STORAGE_BYTES are split in POOL_EXTENTS files of POOL_EXTENT_CHUNKS chunks,
+ *  an extent is handed to a metric group when its last one is full and taken back once it is sent.
+ */
+#define POOL_EXTENTS 16
+#define POOL_EXTENT_CHUNKS (METRIC_STORAGE_BYTES/POOL_EXTENTS/DATA_CHUNK_SIZE)
+
+/** Extents of the metric group pool owned by each group. extent[] of a group is a ring, its oldest extent
+ *  is at head and freeing it only moves head, see NodeFlow::get_mg_extent(). fill[] counts the extents 
+ *  handed to each group and is halved every POOL_EXTENTS hand outs, so it follows the recent fill rate 
+ *  of the groups. When the pool is full the group holding most extents above its share loses its oldest.
+ */
+union PoolConfig
+{
+    struct 
+    {
+        uint8_t extent[METRIC_GROUP_FILES][POOL_EXTENTS];
+        uint8_t head[METRIC_GROUP_FILES];
+        uint8_t extents[METRIC_GROUP_FILES];
+        uint16_t fill[METRIC_GROUP_FILES];
+        uint16_t hand_outs;
+    } parameters;
+
+    char data[sizeof(PoolConfig::parameters)];
+};
+
+/** Slots of the increment files. The slots are folded back to the first one when they are full,
+ *  so each slot is written once every COUNTER_SLOTS increments.
+ */
+#define COUNTER_SLOTS 16
+
+/** Entries of the error log, it starts over when full
+ */
+#define ERROR_LOG_SLOTS 20
 
 /** Eeprom configuration. 
  *
@@ -114,33 +217,53 @@
     };
 #endif
 
-/** */
+/** Packed byte-stream record for the metric group and interrupt files, one byte per payload byte.
+ *  Only full chunks are appended to the files, the rest waits in DataTailConfig.
+ */
 union DataConfig
 {
     struct 
     {
-        uint16_t byte;
+        uint8_t byte[DATA_CHUNK_SIZE];
         
     } parameters;
 
     char data[sizeof(DataConfig::parameters)];
 };
 
+/** Partially filled chunk and ring pointer of a metric group, a record of DataTailConfig_n.
+ *  The chunks before first are sent or evicted, the extent holding them is freed once all its chunks are.
+ *  chunks is written with the tail after every chunk appended, a group holding more chunks at boot was
+ *  cut between the two writes and its tail is already in the last chunk, see NodeFlow::scan_mg_records().
+ *  records counts the records before checked, the boot scan only walks the bytes after it.
+ */
+struct DataTail
+{
+    uint16_t first;
+    uint16_t chunks;            /** Chunks appended to the extents of the group when the tail was written */
+    uint16_t keyframe;          /** First byte of the key frame record */
+    uint8_t keyframe_length;    /** Stored bytes of the key frame record, 0 if none */
+    uint8_t length;
+    uint32_t base_time;         /** UNIX time the record stamps count from, 0 if none */
+    uint16_t records;           /** Records stored in the group */
+    uint16_t checked;           /** Stored bytes counted in records */
+    uint8_t byte[DATA_CHUNK_SIZE];
+};
 
-union MetricGroupEntriesConfig
+/** Tails of every metric group. Index 0 is the interrupt file, 1 the first metric group
+ */
+union DataTailConfig
 {
     struct 
     {
-        uint16_t MetricGroupAEntries;
-        uint16_t MetricGroupBEntries;
-        uint16_t MetricGroupCEntries;
-        uint16_t MetricGroupDEntries;
-        uint16_t InterruptEntries;
+        DataTail group[METRIC_GROUP_FILES];
+        
     } parameters;
 
-    char data[sizeof(MetricGroupEntriesConfig::parameters)];
+    char data[sizeof(DataTailConfig::parameters)];
 };
 
+
 /** The User can define MAX_BUFFER_READING_TIMES 
  */
 union SchedulerConfig
@@ -148,12 +271,63 @@ union SchedulerConfig
     struct 
     {   
         uint16_t time_comparator; 
-        uint8_t group_id;    
+        uint16_t group_id;          /** Mask of the metric groups, bit 0 for the first group */
     } parameters;
 
     char data[sizeof(SchedulerConfig::parameters)];
 };
 
+/** Sense, send and clock synch times of the day, sorted by time. Events at the same time are merged 
+ *  in one mask. Built by NodeFlow::build_event_table() every time a schedule changes.
+ */
+#define EVENT_TABLE_SIZE (MAX_BUFFER_READING_TIMES+MAX_BUFFER_SENDING_TIMES+1)
+#define EVENT_GROUPS    0x0FFF  /** A bit for each metric group */
+#define EVENT_SEND      0x1000
+#define EVENT_CLOCK     0x2000
+#define EVENT_KICK      0x8000  /** Watchdog kick, never stored */
+
+union EventConfig
+{
+    struct 
+    {
+        uint16_t time[EVENT_TABLE_SIZE];    /** Half seconds since midnight, as in the scheduler files */
+        uint16_t mask[EVENT_TABLE_SIZE];
+        uint8_t events;
+        bool interval;                      /** The metric groups are sensed at intervals, see add_interval_events() */
+    } parameters;
+
+    char data[sizeof(EventConfig::parameters)];
+};
+
+/** Deadline of the wake scheduler, see NodeFlow::set_scheduler(). Every source adds the UNIX time of its 
+ *  next event, the earliest deadline is popped with every event due at the same time.
+ */
+struct WakeEvent
+{
+    uint32_t due;
+    uint16_t mask;
+};
+
+#define WAKE_MAX_SLEEP 6600     /** The watchdog is kicked at least this often */
+#ifndef WAKE_TABLE_EVENTS
+    #define WAKE_TABLE_EVENTS 8 /** Events of the table in the window of the next one, pushed with it */
+#endif
+#define WAKE_EVENTS (MAX_METRIC_GROUPS+WAKE_TABLE_EVENTS+1)
+
+/** Seconds an event may run early to share the wake of an earlier event, for each event type. An event of 
+ *  several types uses the smallest window. 0 wakes for every event at its own time.
+ */
+#ifndef WAKE_WINDOW_SENSE
+    #define WAKE_WINDOW_SENSE 5
+#endif
+#ifndef WAKE_WINDOW_SEND
+    #define WAKE_WINDOW_SEND 60
+#endif
+#ifndef WAKE_WINDOW_CLOCK
+    #define WAKE_WINDOW_CLOCK 300
+#endif
+#define WAKE_WINDOW_MAX std::max(std::max(WAKE_WINDOW_SENSE, WAKE_WINDOW_SEND), WAKE_WINDOW_CLOCK)
+
 /** Program specific flags. Every bit is a different flag. 0:SENSE, 1:SEND, 2:CLOCK, 3:KICK
  */
 union FlagsConfig
@@ -179,60 +353,262 @@ union TimeConfig
     char data[sizeof(TimeConfig::parameters)];
 };
 
-union IncrementAConfig
+/** Slot of a wear-levelled counter file. Slot 0 holds the value, every increment appends its 
+ *  value to the next slot. The counter is the sum of the slots written.
+ */
+union CounterConfig
 {
     struct 
     {    
-        uint16_t  increment; 
+        uint64_t  value; 
     } parameters;
 
-    char data[sizeof(IncrementAConfig::parameters)];
+    char data[sizeof(CounterConfig::parameters)];
 };
 
-union IncrementBConfig
+
+/** Last sample of the delta coded series, see NodeFlow::add_delta_record(). A slot is selected by the 
+ *  CRC-16 of the metric group and the key, 0 is a free slot.
+ */
+union DeltaConfig
 {
     struct 
-    {    
-        uint32_t  increment; 
+    {
+        int64_t  value[DELTA_KEYS];
+        uint16_t key[DELTA_KEYS];
+        uint8_t  samples[DELTA_KEYS];   /** Samples written since the absolute one */
     } parameters;
 
-    char data[sizeof(IncrementBConfig::parameters)];
+    char data[sizeof(DeltaConfig::parameters)];
 };
-union IncrementCConfig
+
+/** Upload in progress, kept across wakes so a failed upload resumes at its first unacknowledged block. The 
+ *  groups are uploaded in order from the interrupt. bytes[] and entries[] are the groups when the upload 
+ *  started, the records stored after it wait for the next upload.
+ */
+union SendCursorConfig
 {
     struct 
-    {    
-        uint64_t  increment; 
+    {
+        uint16_t bytes[METRIC_GROUP_FILES];     /** Bytes of each group in the upload */
+        uint16_t entries[METRIC_GROUP_FILES];   /** Records of each group in the upload */
+        uint16_t skip[METRIC_GROUP_FILES];      /** Bytes sent still stored, the rest of a chunk or back to a key frame */
+        uint16_t done;          /** Bytes of the group of the next block acknowledged */
+        uint8_t group;          /** Group of the next block */
+        uint8_t block;          /** Number of the next block */
+        uint8_t cut;            /** Group the upload ends in at UPLOAD_MAX_BLOCKS blocks, UPLOAD_UNCUT if none */
+        uint8_t total_blocks;   /** Blocks of the upload, 0 until they are counted */
+        uint8_t retries;        /** Attempts of the open upload that left a block not acknowledged */
+        bool open;
+    } parameters;
+
+    char data[sizeof(SendCursorConfig::parameters)];
+};
+
+/** Blocks of the open upload delivered, bit n of acked[] is block n. A block is delivered once the CoAP 
+ *  server answers it with 2.xx. A LoRaWAN block is delivered once it's sent, or with UPLOAD_ACKS once the 
+ *  network server acknowledges it on UPLOAD_ACK_PORT. An upload still missing acknowledgements after
+ *  UPLOAD_ACK_RETRIES attempts is taken as delivered. A retransmission skips the blocks delivered.
+ */
+#define UPLOAD_MAX_BLOCKS 222
+#define URGENT_ACK_BLOCK UPLOAD_MAX_BLOCKS       /** Uplink of the urgent groups, acknowledged in urgent */
+#ifndef UPLOAD_ACKS
+    #define UPLOAD_ACKS 0
+#endif
+#ifndef UPLOAD_ACK_PORT
+    #define UPLOAD_ACK_PORT 4
+#endif
+#ifndef UPLOAD_ACK_RETRIES
+    #define UPLOAD_ACK_RETRIES 3
+#endif
+
+/** An upload is cut at UPLOAD_MAX_BLOCKS blocks. The LoRaWAN blocks go out on FPort total_blocks+1, the 
+ *  highest application port is 223. The records of the group it ends in are carried over to the next 
+ *  upload, the groups after it close empty.
+ */
+#define UPLOAD_UNCUT 0xFF
+static_assert(UPLOAD_MAX_BLOCKS+1 <= 223, "The block count of an upload is its FPort");
+
+/** LoRaWAN blocks are sized to the maximum application payload of LORAWAN_DATA_RATE, EU868 DR0 to DR7 by
+ *  default. The radio doesn't report the rate ADR sets, so it is the lowest rate the device is sent at.
+ *  A device kept at a fixed rate sets it for larger blocks.
+ */
+#ifndef LORAWAN_MAX_PAYLOADS
+    #define LORAWAN_MAX_PAYLOADS {51, 51, 51, 115, 222, 222, 222, 222}
+#endif
+#ifndef LORAWAN_DATA_RATE
+    #define LORAWAN_DATA_RATE 0
+#endif
+
+union UploadAckConfig
+{
+    struct 
+    {
+        uint8_t acked[(UPLOAD_MAX_BLOCKS+7)/8];
+        bool urgent;            /** The uplink of the urgent groups is delivered */
     } parameters;
 
-    char data[sizeof(IncrementCConfig::parameters)];
+    char data[sizeof(UploadAckConfig::parameters)];
+};
+
+/** Phases of a wake timed by NodeFlow::phase_end(), the ones NodeFlow::wake_lead() is made of. WAKE runs from 
+ *  start() to the first sensing, an early send of a full pool included. FLUSH is the cache flush before the standby.
+ */
+enum LatencyPhase
+{
+    PHASE_WAKE,
+    PHASE_SENSE,
+    PHASE_FLUSH,
+    LATENCY_PHASES
 };
 
+#define LATENCY_WEIGHT 3        /** A moving average moves by 1/2^LATENCY_WEIGHT of each sample */
+#define LATENCY_RESOLUTION 16   /** Milliseconds an average moves before it's written */
+#define WAKE_MAX_LEAD 30        /** Seconds a wake is moved before its sensing event at most */
 
-/**TODO: Merge with ssck_flags group,Flags for each group */
-union MetricGroupConfig
+/** Moving average of each phase of a wake in milliseconds. Written after the cache flush, so the flush is
+ *  measured too, and only when an average moves by LATENCY_RESOLUTION, see NodeFlow::overwrite_latency_model().
+ */
+union LatencyConfig
 {
     struct 
     {
-        uint16_t metric_group_id;        
-        
+        uint16_t average[LATENCY_PHASES];
     } parameters;
 
-    char data[sizeof(MetricGroupConfig::parameters)];
+    char data[sizeof(LatencyConfig::parameters)];
+};
+
+/** State of the wake cycle, read and written as a single record
+ */
+union WakeStateConfig
+{
+    struct 
+    {
+        uint32_t next_time;         /** Time of the next wakeup, see overwrite_wakeup_timestamp() */
+        uint32_t time_comparator;   /** Time until the next interval reading */
+        uint16_t ssck_flag;         /** Every bit is a different flag. 0:SENSE, 1:SEND, 2:CLOCK, 3:KICK */
+        uint16_t metric_group_id;   /** Flags for each metric group */
+        uint32_t wake_due;          /** UNIX time of the next wake */
+        uint32_t horizon;           /** UNIX time of the last event run early in the next wake */
+        uint32_t wakes_saved;       /** Wakes merged in an earlier wake since initialise() */
+        bool wakeup_pin;
+    } parameters;
 
+    char data[sizeof(WakeStateConfig::parameters)];
 };
 
+/** Entry of the error log, the line of every error is appended
+ */
 union ErrorConfig
 {
     struct 
     {
-        uint16_t errCnt;
-        uint16_t line_arr[20];
+        uint16_t line;
     } parameters;
 
     char data[sizeof(ErrorConfig::parameters)];
 };
 
+/** Schema header, the last file written by initialise(). A reset boot reads it once, the files are kept when
+ *  the magic and the layout hash match the build, see NodeFlow::read_schema(). Otherwise the files are 
+ *  created again and the stored records are migrated in place when the pool rows still match.
+ */
+union SchemaConfig
+{
+    struct 
+    {
+        uint16_t magic;
+        uint16_t version;   /** Format of the records, the records are migrated in place to SCHEMA_VERSION */
+        uint16_t layout;    /** Hash of the files created by initialise(), see NodeFlow::schema_layout() */
+        uint16_t pool;      /** Hash of the pool rows, see NodeFlow::schema_pool_layout() */
+    } parameters;
+
+    char data[sizeof(SchemaConfig::parameters)];
+};
+
+#define SCHEMA_MAGIC 0x4E46
+#define SCHEMA_VERSION 1
+
+/** Rows leading the file table that hold the stored records: the pool extents, PoolConfig_n and DataTailConfig_n
+ */
+#define POOL_FILE_ROWS 3
+
+/** Row of the file table of NodeFlow::initialise()
+ */
+struct FileLayout
+{
+    uint8_t filename;
+    uint8_t record_length;
+    uint16_t records;
+    uint8_t files;
+    uint16_t zero;      /** Zeroed records written */
+};
+
+/** Small config files kept in RAM during a wake, see NodeFlow::cache_load()
+ */
+#define CONFIG_CACHE_FILES 12
+#define CONFIG_CACHE_BYTES (sizeof(WakeStateConfig::parameters) + sizeof(FlagsConfig::parameters) \
+                            + (MAX_BUFFER_READING_TIMES+2)*sizeof(SchedulerConfig::parameters) \
+                            + (MAX_BUFFER_SENDING_TIMES+2)*sizeof(TimeConfig::parameters) \
+                            + 2*MAX_METRIC_GROUPS*sizeof(TimeConfig::parameters) \
+                            + sizeof(DataTailConfig::parameters) + sizeof(PoolConfig::parameters) \
+                            + sizeof(DeltaConfig::parameters) + sizeof(EventConfig::parameters) \
+                            + sizeof(SendCursorConfig::parameters) + sizeof(UploadAckConfig::parameters))
+
+/** Result of NodeFlow::parse_mg_records()
+ */
+struct RecordWalk
+{
+    int consumed;       /** Stored bytes walked */
+    int output;         /** Payload bytes of the valid records */
+    int total_bytes;    /** Bytes stored in the metric group */
+    uint16_t records;
+    uint16_t skipped;
+    uint16_t lost;      /** Records dropped with their key frame, their bytes are in skipped */
+    int keyframe;       /** First byte of the last key frame walked, 0 if none */
+};
+
+/** Write-ahead journal record. A group of writes is appended as file images, each image split in
+ *  DATA_CHUNK_SIZE records, then closed with a commit record holding the number of records and
+ *  their crc. The images are written to their files only after the commit, see NodeFlow::journal_replay()
+ */
+union JournalConfig
+{
+    struct 
+    {
+        uint8_t filename;
+        uint8_t record_length;
+        uint8_t flags;
+        uint8_t length;
+        uint8_t byte[DATA_CHUNK_SIZE];
+    } parameters;
+
+    char data[sizeof(JournalConfig::parameters)];
+};
+
+#define JOURNAL_IMAGE  0x01     /** First record of a file image */
+#define JOURNAL_COMMIT 0x02     /** Commit record, length is the number of records and byte[0-1] the crc */
+#define JOURNAL_ENTRIES ((CONFIG_CACHE_BYTES+sizeof(CounterConfig::parameters))/DATA_CHUNK_SIZE + 2*CONFIG_CACHE_FILES + 3)
+
+/** RAM copy of a config file. Write back files are only written to the eeprom by 
+ *  NodeFlow::cache_flush(), write through files are written immediately.
+ */
+struct ConfigCache
+{
+    uint8_t filename;
+    uint8_t record_length;
+    uint8_t capacity;
+    uint8_t entries;
+    bool write_through;
+    bool journaled;     /** Lands together with the other journaled files, see NodeFlow::cache_flush() */
+    bool loaded;
+    bool valid;
+    bool dirty;
+    bool touched;       /** Changed in the open journal, read again from the eeprom if the journal is dropped */
+    char* data;
+};
+
 /** Each filename in the eeprom hold a unique number
  */
 enum Filenames
@@ -242,24 +618,41 @@ enum Filenames
     SchedulerConfig_n               = 2,
     SendSchedulerConfig_n           = 3,
     ClockSynchFlag_n                = 4,
-    FlagSSCKConfig_n                = 5,
-    NextTimeConfig_n                = 6,
-    TimeConfig_n                    = 7,
-    MetricGroupConfig_n             = 8,
+    WakeStateConfig_n               = 5,
+    LatencyConfig_n                 = 11,
+    SendCursorConfig_n              = 12,
+    UploadAckConfig_n               = 13,
     MetricGroupTimesConfig_n        = 9, 
     TempMetricGroupTimesConfig_n    = 10,
-    MetricGroupAConfig_n            = 11,
-    MetricGroupBConfig_n            = 12,
-    MetricGroupCConfig_n            = 13,
-    MetricGroupDConfig_n            = 14,
-    MetricGroupEntriesConfig_n      = 15,
     InterruptConfig_n               = 16,
     IncrementAConfig_n              = 17,
     IncrementBConfig_n              = 18,
     IncrementCConfig_n              = 19,
+    DataTailConfig_n                = 20,
+    JournalConfig_n                 = 6,
+    PoolConfig_n                    = 15,
+    DeltaConfig_n                   = 7,
+    SchemaConfig_n                  = 8,
+    EventConfig_n                   = 37,
+    MetricPoolConfig_n              = 21, /**First of the POOL_EXTENTS extent files */
+    MetricGroupConfig_n             = 38, /**Id of the first metric group, the ids of the MAX_METRIC_GROUPS groups 
+                                            *follow. The data are stored in the pool extents */
 
  };
 
+/** Metric group registered by the application, see NodeFlow::add_metric_group()
+ */
+struct MetricGroup
+{
+    Callback<void()> sense;
+    uint32_t interval;      /** Seconds between readings, 0 if the group is read at times of the day */
+    const float* times;     /** Times of the day in HH.MM */
+    uint8_t length;
+    uint8_t extents;        /** Pool extents the group may hold, 0 for no limit and at least 2 */
+    uint8_t priority;       /** SEND_PRIORITY_NORMAL unless set */
+    uint32_t deadline;      /** Seconds the oldest record may wait for the upload, 0 for the send schedule */
+};
+
 /** Nodeflow Class
  */
 class NodeFlow: public DataManager
@@ -359,26 +752,81 @@ class NodeFlow: public DataManager
          */
         virtual void HandleInterrupt() = 0;
 
-        /** MetricGroupA-D() allows the user to periodically read any sensors that are on the board. Every variant 
-         *  of a board is different, uses different sensors, and thus requires application-specific code in order
-         *  to interact with the sensors.
-         */  
-        virtual void MetricGroupA() = 0; 
-       
-        virtual void MetricGroupB() = 0;
-      
-        virtual void MetricGroupC() = 0;
-    
-        virtual void MetricGroupD() = 0;
-    
         /** Virtual functions END ************************************************************************************/
 
+        /** add_metric_group() allows the user to periodically read any sensors that are on the board. Every variant 
+         *  of a board is different, uses different sensors, and thus requires application-specific code in order
+         *  to interact with the sensors. Groups are registered in the constructor of the application, in the same 
+         *  order on every boot, before start().
+         *
+         *@param sense     Reads the sensors of the group and adds their records
+         *@param interval  Seconds between readings
+         *@param times     Times of the day in HH.MM, the array must outlive the NodeFlow
+         *@param length    Number of times
+         *@param extents   Pool extents the group may hold, its oldest data are dropped first. 0 for no limit, a
+         *                 group keeps the extent it writes in so a limit below 2 holds 2
+         *@return          Id of the group, 1 for the first one, or a negative error
+         */
+        int add_metric_group(Callback<void()> sense, uint32_t interval, uint8_t extents=0);
+        int add_metric_group(Callback<void()> sense, const float* times, uint8_t length, uint8_t extents=0);
+
+        /** Sets the send priority of a registered group. Urgent groups are uploaded in uplinks of their own right
+         *  after the wake that stores their records, whatever the backlog of the other groups. Their records
+         *  are stored uncompressed, delta coded series of an urgent group must not be shared with other groups.
+         *  The other groups are uploaded in priority order, a group past its deadline starts the upload.
+         *
+         *@param group     Id returned by add_metric_group()
+         *@param priority  SEND_PRIORITY_URGENT to SEND_PRIORITY_BULK
+         *@param deadline  Seconds the oldest record of the group may wait for the upload, 0 for none
+         *@return          NODEFLOW_OK or METRIC_GROUP_INVALID
+         */
+        int set_metric_group_priority(uint8_t group, uint8_t priority, uint32_t deadline=0);
+
+        /** Wakes the scheduler merged in an earlier wake since the eeprom was initialised, each one a
+         *  start of the processor and often of the radio that was saved
+         */
+        int get_wakes_saved(uint32_t& wakes);
+
         
         /** start() drives all the application. It handles the different modem and configuration.
          */
         void start();
 
         int CreateFile(DataManager_FileSystem::File_t file, uint8_t filename, int struct_size, int length);
+
+        /** SCHEMA****************************************************************************************************/
+        /** Reads the schema header
+         *
+         *@param initialised   Set if the files were created by a build with the same layout and SCHEMA_VERSION
+         *@param keep_pool     Set if they were not, but the pool rows of that build match this one
+         */
+        int read_schema(bool& initialised, bool& keep_pool);
+
+        /** Writes the schema header of this build
+         */
+        int overwrite_schema();
+
+        /** Hash of the filename, record length and records of each file created by initialise(), in order.
+         *  Any change moves the files in the eeprom and they must be created again.
+         */
+        uint16_t schema_layout();
+
+        /** Hash of the first POOL_FILE_ROWS rows of the file table. The other rows never move them in the eeprom.
+         */
+        uint16_t schema_pool_layout();
+
+        /** Reads the pool, the tails and the chunks written to each extent by the build that created the 
+         *  files, before initialise() creates them again.
+         */
+        int read_schema_pool(PoolConfig& pool_conf, DataTailConfig& tail_conf, int* chunks);
+
+        /** Migrates the stored records in place to the files of this build. DataManager lays the files out
+         *  in the order they are added, so the extents start at the bytes they held and every chunk is
+         *  appended again over itself. The pool and the tails are written back, the next record of every 
+         *  group is a key frame. A reset before the schema header is written loses the records.
+         */
+        int migrate_schema(PoolConfig& pool_conf, DataTailConfig& tail_conf, const int* chunks);
+
         /**Template function for handling the different data types
          */
         template <typename DataType>
@@ -386,7 +834,16 @@ class NodeFlow: public DataManager
          *
          *@param data Actual data to be written to the eeprom
          */
-        void add_record(DataType data, string str=NULL);
+        void add_record(DataType data, string str="");
+
+        /**add_delta_record(DataType data) for integer series that change slowly between samples, written 
+         * as the difference from the previous sample of the same key in the metric group
+         *
+         *@param data Actual data to be written to the eeprom
+         *@param str  Key of the series, required for the delta
+         */
+        template <typename DataType>
+        void add_delta_record(DataType data, string str="");
 
         void UploadNow();
 
@@ -430,13 +887,52 @@ class NodeFlow: public DataManager
          *@param increment_value increment_value
          */
         int read_inc_c(uint64_t& increment_value);
+
+        /**Wear-levelled counter files, see CounterConfig. An increment is a single append, 
+         * reading sums the slots. 
+         *
+         *@param filename  IncrementAConfig_n, IncrementBConfig_n or IncrementCConfig_n
+         */
+        int read_counter(uint8_t filename, uint64_t& value);
+        int increment_counter(uint8_t filename, uint64_t i);
+        int overwrite_counter(uint8_t filename, uint64_t value);
         
         #if BOARD == EARHART_V1_0_0 || BOARD == DEVELOPMENT_BOARD_V1_1_0 /* #endif at EoF */
         void getDevAddr();
         #endif
 
         //todo: move this
-        void read_write_entry(uint8_t group_tag, int start_len, int end_len, uint8_t filename);
+        /**Writes the valid records stored between start_len and end_len to the TX buffer
+         *
+         *@param first         The group starts in this block, its tag and base time are written first
+         *@param room          Bytes that can be written to the TX buffer
+         *@param consumed      Stored bytes used, less than end_len-start_len when the next record
+         *                     does not fit in room
+         */
+        void read_write_entry(uint8_t group_tag, bool first, int start_len, int end_len, uint8_t filename, int room, int& consumed);
+
+        /** Writes the tag and base time opening the record array of a group to the TX buffer. It fails with
+         *  TX_BUFFER_FULL unless the buffer takes the head and the break byte closing the array. */
+        int write_group_head(uint8_t group_tag, uint8_t filename);
+
+        /** Writes the break byte closing the record array of a group to the TX buffer */
+        int write_group_break();
+
+        /**Walks the records stored in a metric group between two bytes. Bytes that don't start a record
+         * with a valid length and CRC are skipped one by one until a valid record is found.
+         *
+         *@param filename      Metric group id
+         *@param start         First byte, the key frame is reset if 0
+         *@param end           Last byte, a record that continues after it is left for the next call
+         *@param room          Payload bytes that can be written, -1 for no limit
+         *@param write         Writes the payload of the valid records to the TX buffer
+         *@param walk          Bytes walked and written, records found and bytes skipped
+         */
+        int parse_mg_records(uint8_t filename, int start, int end, int room, bool write, RecordWalk& walk);
+
+        /**Validates the records of every metric group at boot and sets the entries counters to the valid records
+         */
+        int scan_mg_records();
     private:
 
         void _test_provision();
@@ -452,9 +948,10 @@ class NodeFlow: public DataManager
 
         /** Initialise files after reset, set flags
          * 
+         * @param keep_pool Migrate the stored records of the earlier build, see migrate_schema()
          * @return          It could be one of these:
          */
-        int initialise(); 
+        int initialise(bool keep_pool=false); 
         
         /**Time Related functions ********************************************************************************/
         
@@ -485,7 +982,7 @@ class NodeFlow: public DataManager
          * @return          Time
          *                  
          */ 
-        int timetoseconds(float scheduler_time, uint8_t group_id);
+        int timetoseconds(float scheduler_time, uint16_t group_id);
         
       
         /** Holds the time until the next wakeup
@@ -495,15 +992,14 @@ class NodeFlow: public DataManager
          */ 
         int set_time_config(int time_comparator);
 
+        /** Read/ overwrite the wake cycle state, flags, wakeup times and metric group counters
+         */
+        int read_wake_state(WakeStateConfig& ws_conf);
+        int overwrite_wake_state(WakeStateConfig& ws_conf);
+
         /**Interval/ periodic sensing of metric groups *******************************************************
          */
 
-        /** Initialise the metric groups file.
-         *                 
-         * @return          It could be one of these:
-         *                  
-         */ 
-        int metric_config_init(int length);
         /** Adds the metric groups for interval sensing times, handles each group differently
          *                 
          * @return          It could be one of these:
@@ -511,21 +1007,57 @@ class NodeFlow: public DataManager
          */    
         void add_metric_groups(); 
 
-        /** Sets the next reading time for interval periodic sensing, handles each group differently
-         *                 
-         * @param time      The sleeping time until next reading/sensing etc sensors measurement in seconds.
-         * @return          It could be one of these:
-         *                  
-         */        
-        int set_reading_time(uint32_t& time); 
+        /** Adds the next deadline of every interval sensed metric group. The deadlines are kept in 
+         *  TempMetricGroupTimesConfig_n as UNIX times, a deadline further than its period is moved to now+period.
+         */
+        void add_interval_events(uint32_t now);
 
-        /** Fixes the next reading times after interrupt/clock etc interrupt for each group differently
-         *                 
-         * @param time      The sleeping time until next reading/sensing etc sensors measurement in seconds.
-         * @return          It could be one of these:
-         *                  
+        /** Moves the deadline of the interval groups due at the next wake by their period
+         *
+         * @param due       UNIX time of the next wake
+         * @param mask      Metric group ids due
+         */
+        int reschedule_interval_events(uint32_t due, uint16_t mask, uint32_t now);
+
+        /** Pushes a deadline on the wake scheduler heap */
+        void add_wake_event(uint32_t due, uint16_t mask);
+
+        /** Pops the earliest deadline and every event due within the wake window of its type
+         *
+         * @param mask      Masks of the events, merged
+         * @param horizon   UNIX time of the last event popped
+         * @param saved     Wakes merged in the earliest one
+         * @return          UNIX time of the deadline
          */
-         int set_temp_reading_times(uint32_t time);
+        uint32_t next_wake_event(uint16_t& mask, uint32_t& horizon, uint8_t& saved);
+
+        /** Seconds the event may run early, the smallest window of its types */
+        uint16_t wake_window(uint16_t mask);
+
+        /** Keeps the next wake and the last event merged in it, so the events of the table up to the 
+         *  horizon aren't scheduled again after the wake
+         *
+         * @param saved     Wakes merged, added to the counter
+         */
+        int overwrite_wake_horizon(uint32_t due, uint32_t horizon, uint8_t saved);
+
+        /** LATENCY MODEL*********************************************************************************************/
+        /** Starts the timing of a phase */
+        void phase_begin();
+
+        /** Adds the milliseconds since phase_begin() to the phase */
+        void phase_end(uint8_t phase);
+
+        /** Folds the phases timed in this wake in their moving averages, the others are kept. Nothing is written
+         *  unless an average moves by LATENCY_RESOLUTION, so it lags by 2^LATENCY_WEIGHT*LATENCY_RESOLUTION ms at most. */
+        int overwrite_latency_model();
+
+        int read_latency_model(LatencyConfig& l_conf);
+
+        /** Seconds a wake is moved before a sensing event, so the samples land on its time. The wake phase, half
+         *  of the sensing and the flush before the previous standby, rounded.
+         */
+        uint16_t wake_lead();
         
         /** Specific times for each sensing of metric groups *******************************************************
          */
@@ -544,6 +1076,24 @@ class NodeFlow: public DataManager
          */     
         void set_scheduler(int latency, uint32_t& next_timediff);
 
+        /** Rebuilds the event table from the scheduler, send scheduler and clock synch files
+         */
+        int build_event_table();
+
+        /** Inserts an event in time order, merging it with an event at the same time
+         */
+        void add_event(EventConfig& e_conf, uint16_t time, uint16_t mask);
+
+        /** Binary search of the event table for the next event. An event the wake ran over is due in a second.
+         *
+         * @param now       Seconds since midnight
+         * @param latency   Seconds since the start of the wake
+         * @param timediff  Seconds until the event, DAYINSEC if there is none
+         * @param mask      Metric group ids, EVENT_SEND and EVENT_CLOCK of the event
+         * @return          Set if the metric groups are sensed at intervals
+         */
+        bool next_event(uint32_t now, int latency, uint32_t& timediff, uint16_t& mask);
+
         /** Scheduler holds the length and group id for each specific times 
          *                  
          * @param time      The sleeping time until next reading/sensing etc sensors measurement in seconds.
@@ -552,7 +1102,7 @@ class NodeFlow: public DataManager
          */ 
         int read_sched_config(int i,uint16_t& time_comparator);
 
-        int read_sched_group_id(int i,uint8_t& time_comparator);
+        int read_sched_group_id(int i,uint16_t& group_id);
         /** Overwrite the Scheduler holds the length and group id for each specific time. 
          *                                      
          */ 
@@ -560,7 +1110,7 @@ class NodeFlow: public DataManager
          /** Append entries to the scheduler. 
          *                                      
          */ 
-        int append_sched_config(uint16_t time_comparator, uint8_t group_id);
+        int append_sched_config(uint16_t time_comparator, uint16_t group_id);
 
         /** Initialise the Send Scheduler for reading metric groups at specific times each day. 
          *                  
@@ -637,69 +1187,229 @@ class NodeFlow: public DataManager
          */
         int set_wakeup_pin_flag(bool wakeup_pin);
 
-        /** Metric flags are used for each of the groups A to D. 
+        /** Metric flags are used for each of the registered groups. 
          *
-         *@return               A decimal represantation of:
-         *                      MetricGroupA = dec(1)
-         *                      MetricGroupB = dec(2) 
-         *                      MetricGroupA&&B = dec(3)
-         *                      MetricGroupC = dec(4)
-         *                      MetricGroupA&&C = dec(5) 
-         *                      MetricGroupB&&C = dec(6)
-         *                      MetricGroupA&&B&&C  = dec(7)
-         *                      MetricGroupD = dec(8)
-         *                      ..
-         *                      MetricGroupA&&B&&C&&D = dec(15)
+         *@return               A bit for each group read at the next wake, bit 0 for the first group
          */
-        int overwrite_metric_flags(uint8_t ssck_flag);
+        int overwrite_metric_flags(uint16_t ssck_flag);
 
-        /** Get metric flags are used for each of the groups A to D in order to handle each group after a wakeup timer. 
+        /** Get metric flags are used for each of the registered groups in order to handle each group after a wakeup timer. 
          *
-         *@return               A decimal represantation of:
-         *                      MetricGroupA = dec(1)
-         *                      MetricGroupB = dec(2) 
-         *                      MetricGroupA&&B = dec(3)
-         *                      MetricGroupC = dec(4)
-         *                      MetricGroupA&&C = dec(5) 
-         *                      MetricGroupB&&C = dec(6)
-         *                      MetricGroupA&&B&&C  = dec(7)
-         *                      MetricGroupD = dec(8)
-         *                      ..
-         *                      MetricGroupA&&B&&C&&D = dec(15)
+         *@return               A bit for each group read at this wake, bit 0 for the first group
          */
-        int get_metric_flags(uint8_t &flag);
+        int get_metric_flags(uint16_t &flag);
 
 
+        /** Appends the serialised record of the tformatter to the metric group file. The bytes
+         *  are packed in DATA_CHUNK_SIZE records so a record costs a few page writes instead of 
+         *  one write per byte.
+         */
         int add_payload_data(uint8_t metric_group_flag);
         
         void _sense();
         int _send();
-        int _divide_to_blocks(uint8_t group, uint8_t filename, uint16_t buffer_len, uint16_t&available);
-        int _send_blocks();
+
+        /** Sends the blocks of the upload from the cursor, begun if none is open. The blocks of a new upload
+         *  are counted first, the count is their FPort and it cuts the upload, see UPLOAD_UNCUT.
+         */
+        int send_upload();
+
+        /** Divides the upload in blocks from the cursor and sends them, or only counts them in send_block_number */
+        int divide_upload(SendCursorConfig& c_conf, uint8_t metric_group_active, bool count);
+
+        /** Bytes of a block, the maximum payload of LORAWAN_DATA_RATE on LoRaWAN */
+        uint16_t get_block_size();
+
+        /** Groups after metric_group in the send order that are in the upload */
+        uint8_t get_groups_after(const SendCursorConfig& c_conf, uint8_t metric_group);
+        /** Uploads the records of the urgent groups, each block an uplink of its own released once delivered.
+         *  The upload of the other groups is left where it is.
+         */
+        int _send_urgent();
+        int send_urgent_group(uint8_t metric_group, uint8_t filename);
+        bool is_urgent_pending();
+
+        /** True when the oldest record of a group with a deadline has waited for it */
+        bool is_deadline_due();
+
+        /** Send priority of a metric group, index 0 is the interrupt file */
+        uint8_t get_mg_priority(uint8_t metric_group);
+
+        /** Metric groups in upload order, by priority then index */
+        void get_send_order(uint8_t* order);
+        uint8_t get_send_position(const uint8_t* order, uint8_t metric_group);
+
+        /** Releases the first sent bytes of a group, all of them when sent is negative or covers the stored 
+         *  ones. The bytes sent of the first chunk left are skipped by the next upload.
+         */
+        void release_mg_bytes(uint8_t metric_group, PoolConfig& pool_conf, DataTailConfig& tail_conf, int sent, int stored,
+                              uint16_t& skip);
+
+        /** Sends the bytes of a group in the upload from the cursor, the cursor is moved past every block sent.
+         *  The upload is cut in this group if it reaches its last block, see UPLOAD_UNCUT.
+         */
+        int _divide_to_blocks(uint8_t group, uint8_t filename, SendCursorConfig& c_conf, uint16_t&available);
+
+        /** Opens the cursor on the bytes stored in every group, left closed if there is nothing to send. The
+         *  records stored during the upload start with a key frame, so the ones sent can be released.
+         */
+        int begin_upload(SendCursorConfig& c_conf);
+
+        int read_send_cursor(SendCursorConfig& c_conf);
+        int overwrite_send_cursor(SendCursorConfig& c_conf);
+
+        /** Sends the block in tx_buffer unless it was delivered by an earlier attempt. A block sent but not
+         *  acknowledged sets upload_gap, the cursor then stays on the first block missing.
+         */
+        int _send_blocks(bool last_block);
+
+        int read_upload_acks(UploadAckConfig& a_conf);
+        int overwrite_upload_acks(UploadAckConfig& a_conf);
+        bool is_block_acked(const UploadAckConfig& a_conf, uint16_t block);
+        int mark_block_acked(uint16_t block);
+
+        /** Blocks from the block given on are divided again, their acknowledgements no longer hold. 
+         *  URGENT_ACK_BLOCK clears the urgent uplink only. */
+        int clear_block_acks(uint16_t block);
+
+        /** Moves the bytes written to the tformatter to the TX buffer, only the main object and the group 
+         *  tags are encoded by the tformatter
+         */
+        void tx_append_formatter();
         
-        /**Adds a bytes of sensing entries added as record by the user.
+        /**Adds the bytes of sensing entries added as record by the user.
+         *
+         *@param data          Serialised bytes
+         *@param length        Number of bytes
+         *@param metric_group  0 for the interrupt file, 1 for the first registered group
+         *@param keyframe      The bytes are an uncompressed record, the next records are compressed against it
          */
-        int add_sensing_entry(uint8_t value, uint8_t metric_group);
+        int add_sensing_entries(uint8_t* data, size_t length, uint8_t metric_group, bool keyframe=false);
 
-        void is_overflow();
+        /**Writes the time stamp of a new record, sets the base time of the group on its first record
+         *
+         *@param data          At least RECORD_STAMP_SIZE bytes
+         *@param length        Bytes written
+         */
+        int stamp_record(uint8_t metric_group, uint8_t* data, size_t& length);
 
-        /**Counter for each metric group entry
-         * 
-         *@param mg_flag which metric group to increment
+        /**Encodes a CBOR integer, major type 0 or 1 with the shortest argument
+         *
+         *@return              Bytes written, at most 9
+         */
+        uint8_t cbor_int(int64_t value, uint8_t* data);
+
+        /**Compresses a record payload in place against the key frame of its group
+         *
+         *@param length        Payload bytes, the compressed bytes on return
+         *@param keyframe      Set if the payload is left uncompressed and becomes the key frame
          */
-        int increase_mg_entries_counter( uint8_t mg_flag);
+        int compress_payload(uint8_t metric_group, uint8_t* data, size_t& length, bool& keyframe);
+
+        /**LZ77 over a window made of the key frame followed by the bytes already coded. The output starts
+         * with the CRC of the key frame, then tokens: 0x00-0x7F a run of token+1 literals, 
+         * 0x80-0xFF a match of (token&0x7F)+COMPRESSION_MIN_MATCH bytes followed by its window offset.
+         *
+         *@return              Compressed bytes, -1 if they would not be fewer than max_length
+         */
+        int compress_record(const uint8_t* data, int length, const uint8_t* window, int window_length, 
+                            uint16_t window_crc, uint8_t* out, int max_length);
+
+        /**Decompresses a record against record_window
+         *
+         *@return              Decompressed bytes, -1 if the record is corrupt or its key frame was not read
+         */
+        int decompress_record(const uint8_t* data, int length, uint8_t* out);
+
+        /**Swaps a sample of a delta coded series for its difference from the previous one
+         *
+         *@param key           Key of the series
+         *@param value         The sample
+         *@param delta         Difference from the previous sample
+         *@return              True if delta is set, false if the sample must be written absolute
+         */
+        bool get_delta(const string& key, int64_t value, int64_t& delta);
+
+        /**Filename of a metric group file
+         *
+         *@param metric_group  0 for the interrupt file, 1 for the first registered group
+         *@return              The filename or 0 if the group is not enabled
+         */
+        uint8_t get_mg_filename(uint8_t metric_group);
+
+        /**Metric group of a metric group file, the inverse of get_mg_filename()
+         */
+        uint8_t get_mg_group(uint8_t filename);
+
+        /**Read/ overwrite the partially filled chunks of all metric group files
+         */
+        int read_mg_tail(DataTailConfig& tail_conf);
+        int overwrite_mg_tail(DataTailConfig& tail_conf);
+
+        /**Bytes stored in a metric group after the ring pointer, full chunks plus its tail
+         */
+        int get_mg_file_bytes(uint8_t filename, DataTailConfig& tail_conf, int& bytes);
+
+        /**Chunks appended to the extents of a metric group, including the ones before the ring pointer
+         */
+        int get_mg_chunks(uint8_t metric_group, PoolConfig& pool_conf, int& chunks);
+
+        /**Moves the ring pointer of a metric group past its oldest bytes, rounded down to whole 
+         * chunks. The extents left behind the pointer are freed.
+         *
+         *@param filename      Metric group id
+         *@param pool_conf     Pool table, written back by the caller
+         *@param tail_conf     Tail of the metric groups, written back by the caller
+         *@param bytes         Number of bytes to acknowledge, -1 for all bytes including the tail
+         */
+        int ack_mg_bytes(uint8_t filename, PoolConfig& pool_conf, DataTailConfig& tail_conf, int bytes);
+
+        /**Extent of a group, n from its oldest one
+         */
+        uint8_t get_mg_extent(const PoolConfig& pool_conf, uint8_t metric_group, uint8_t n);
+
+        /**Read/ overwrite the pool table
+         */
+        int read_pool(PoolConfig& pool_conf);
+        int overwrite_pool(PoolConfig& pool_conf);
+
+        /**Hands a free extent to a metric group, evicting one if the pool is full. Both tables are written.
+         */
+        int allocate_mg_extent(uint8_t metric_group, PoolConfig& pool_conf, DataTailConfig& tail_conf);
+
+        /**Frees the oldest extent of the group holding most extents above its share of the pool. Only a group 
+         * holding more than one extent loses one, the records dropped are taken off its record count.
+         * A victim given by the caller must hold 2 extents or more.
+         *
+         *@param victim        Group losing the extent, METRIC_GROUP_FILES for the one above its share
+         */
+        void evict_mg_extent(PoolConfig& pool_conf, DataTailConfig& tail_conf, uint8_t victim=METRIC_GROUP_FILES);
+
+        /**Reads a contiguous span of a metric group file into a buffer, one read per chunk
+         *
+         *@param filename      Metric group file
+         *@param start         First byte of the span
+         *@param length        Number of bytes, clipped to the bytes stored on return
+         *@param data          Buffer of at least length bytes
+         *@param total_bytes   Total bytes stored in the file
+         */
+        int read_mg_span(uint8_t filename, int start, int& length, uint8_t* data, int& total_bytes);
+
+        void is_overflow();
 
         /**Read current counter for each metric group entry
          * 
+         *@param entries       METRIC_GROUP_FILES counters, 0 is the interrupt
          *@return mg_entries for each group
          */
-        int read_mg_entries_counter(uint16_t& mga_entries, uint16_t& mgc_entries,uint16_t& mgd_entries, uint16_t& mgb_entries, uint16_t& interrupt_entries, uint8_t & metric_group_active);
+        int read_mg_entries_counter(uint16_t* entries, uint8_t& metric_group_active);
         
         /**Read current bytes written for each metric group
          * 
+         *@param bytes         METRIC_GROUP_FILES byte counts, 0 is the interrupt
          *@return mg_bytes for each mgroup
          */
-        int read_mg_bytes(int& mga_bytes, int& mgb_bytes, int& mgc_bytes, int& mgd_byte, int& interrupt_bytes); 
+        int read_mg_bytes(int* bytes); 
 
         /** INTERRUPT**************************************************************************************************/
         /** Handle Interrupt 
@@ -719,18 +1429,109 @@ class NodeFlow: public DataManager
         int overwrite_wakeup_timestamp(uint16_t time_remainder);
 
         /** CLEARS**************************************************************************************************/
-        /**Clear the counter entries
+        /**Subtracts the records uploaded from the counter of each group, the tail is written by the caller
+         *
+         *@param tail_conf     Tails holding the counters
+         *@param sent          Records of each group uploaded, NULL for all
          */
-        int clear_mg_counter();
+        void clear_mg_counter(DataTailConfig& tail_conf, const uint16_t* sent=NULL);
 
         /**Clears the increment/s.
          */
         int clear_increment();
 
-        /**Clears the increment/s && the eeprom after sending
+        /**Clears the increment/s && the eeprom after sending. Only the bytes of the upload are released, the
+         *  records stored since are kept.
          */
         int clear_after_send();
 
+        /** CONFIG CACHE**********************************************************************************************/
+        /** Loads the small config files into RAM. Called once at the top of a wake, each file is read
+         *  on its first access and every later read is served from RAM.
+         */
+        void cache_load();
+
+        /** Reads a single config file into its cache entry
+         */
+        int load_config(ConfigCache* cache);
+
+        /** Writes the dirty config files back to the eeprom, the journaled ones through the journal when more 
+         *  than one of them is dirty. Called once before entering standby and by 
+         *  ErrorHandler() before a reset. A watchdog or brown-out reset during the wake loses the write back
+         *  files changed in it: the entries counters are counted again by scan_mg_records(), the schedules
+         *  are built again by the boot and an open upload resumes at an earlier block.
+         */
+        int cache_flush();
+
+        /** Cache entry of a config file 
+         *
+         *@return               The cache entry or NULL if the file is not cached
+         */
+        ConfigCache* get_config_cache(uint8_t filename);
+
+        /** Writes a single cached file back to the eeprom 
+         */
+        int flush_config(ConfigCache* cache);
+
+        /** Read/ overwrite/ append a config file, through the cache when the file is cached.
+         *  Same arguments as the DataManager functions.
+         */
+        int read_config(uint8_t filename, int i, char* data, int length);
+        int overwrite_config(uint8_t filename, char* data, int length);
+        int append_config(uint8_t filename, char* data, int length);
+
+        /** Overwrites record i of a config file, the file is only written if the record changed
+         */
+        int modify_config(uint8_t filename, int i, char* data, int length);
+
+        ConfigCache config_cache[CONFIG_CACHE_FILES];
+        char config_cache_pool[CONFIG_CACHE_BYTES];
+        bool config_cache_loaded=false;
+        bool reset_flush=false;
+
+        /** JOURNAL***************************************************************************************************/
+        /** Opens a group of writes that either all land or none. Until journal_commit() the write through
+         *  files are kept in the cache and overwrite_counter() is journaled, reads still return the old counter.
+         */
+        void journal_begin();
+
+        /** Journals the dirty cached files, appends the commit record and writes the files from RAM. The 
+         *  journal is cleared without reading it back.
+         */
+        int journal_commit();
+
+        /** Drops the open journal. The cached files changed in it are read again from the eeprom, so 
+         *  none of its writes land.
+         */
+        void journal_abort();
+
+        /** Appends the image of a file to the journal
+         *
+         *@param filename       File to overwrite
+         *@param record_length  Record length of the file
+         *@param data           The records of the file, the file is cleared if length is 0
+         *@param length         Bytes of data
+         */
+        int journal_write(uint8_t filename, uint8_t record_length, const char* data, int length);
+
+        /** Writes a committed journal to its files and clears it, a journal without a valid commit record
+         *  is dropped. Called by start() so a group cut by a reset is completed or rolled back.
+         */
+        int journal_replay();
+
+        /** CRC-16/CCITT of a buffer
+         */
+        uint16_t crc16(const char* data, int length, uint16_t crc=0xFFFF);
+
+        bool journal_open=false;
+        uint16_t journal_crc=0;
+        uint8_t journal_records=0;
+
+        /** Increment files overwritten in the open journal, bit 0 for IncrementAConfig_n, and their values
+         */
+        uint8_t journal_counters=0;
+        uint64_t journal_counter[3];
+
         /** SLEEP MANAGER*********************************************************************************************/
         /** Manage device sleep times before calling sleep_manager.standby().
          *  Ensure that the maximum time the device can sleep for is 6600 seconds,
@@ -818,17 +1619,60 @@ class NodeFlow: public DataManager
         void eeprom_debug();
         void tracking_memory();
         
-        #if(SCHEDULER)
-            float* scheduler;
-        #endif
-        uint8_t* buffer;
         uint8_t* buff; //todo remove
-        char* recv_data;
+        char recv_data[50];
         int status;
         bool upload_flag=false;
 
         uint8_t send_block_number=0;
-        uint8_t total_blocks=0;
+        uint8_t total_blocks=0;     /** Blocks of the upload being sent, see SendCursorConfig::total_blocks */
+        bool counting_blocks=false; /** divide_upload() counts the blocks, nothing is sent */
+        bool upload_gap=false;
+        bool urgent_upload=false;
+        uint16_t ack_block=0;   /** Block in flight or URGENT_ACK_BLOCK, see UploadAckConfig */
+
+        /** DataManager calls issued by the metric group storage and the config files during this wake, each
+         *  one is one or more I2C transactions
+         */
+        uint16_t eeprom_calls=0;
+
+        /** Started by start(), times the phases of this wake in milliseconds
+         */
+        Timer wake_timer;
+        uint32_t phase_start=0;
+        uint32_t phase_ms[LATENCY_PHASES]={};
+        uint8_t phases_run=0;
+
+        /** Scratch buffer for the span of each TX block read by read_write_entry()
+         */
+        uint8_t span_buffer[TP_TX_BUFFER];
+
+        /** Block being uploaded. The records are copied from the span to it and it is handed to the radio,
+         *  there is no allocation per block.
+         */
+        uint8_t tx_buffer[TP_TX_BUFFER];
+        uint16_t tx_length=0;
+
+        /** Key frame of the group read by parse_mg_records(), the window of decompress_record()
+         */
+        uint8_t record_window[MAX_RECORD_SIZE];
+        uint8_t record_window_length=0;
+        uint16_t record_window_crc=0;
+
+        /** Metric group being sensed, 0 for the interrupt and 1 for the first registered group
+         */
+        uint8_t sensing_group=0;
+
+        /** Metric groups registered by the application, in RAM only. Their schedules are written to 
+         *  the scheduler files by init_sched_config().
+         */
+        MetricGroup metric_groups[MAX_METRIC_GROUPS];
+        uint8_t metric_group_count=0;
+
+        /** Min heap of the wake scheduler, rebuilt by set_scheduler()
+         */
+        WakeEvent wake_heap[WAKE_EVENTS];
+        uint8_t wake_events=0;
 
         // int filenames_len=Filenames::length;
         /**
@@ -840,7 +1684,10 @@ class NodeFlow: public DataManager
             LORAWAN_TP_FAILED           = -2,
             NBIOT_TP_FAILED             = -3,
             EEPROM_DRIVER_FAILED        = -4,
-            SEND_FAILED                 = -5
+            SEND_FAILED                 = -5,
+            METRIC_GROUPS_FULL          = -6,
+            METRIC_GROUP_INVALID        = -7,
+            TX_BUFFER_FULL              = -8
 
         };
 };